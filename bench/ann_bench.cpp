@@ -0,0 +1,369 @@
+// Recall vs. latency benchmark for the vector search.
+//
+// Loads an index from artifacts/ (or generates clustered synthetic vectors),
+// takes exact top-k from the brute-force VectorIndex::search as ground
+// truth, and sweeps the parameters of each approximate backend. Reports
+// recall@k, QPS, p50/p99 latency and memory per configuration as CSV
+// (default) or JSON.
+//
+//   g++ -std=c++17 -O2 -pthread bench/ann_bench.cpp -o ann_bench
+//   ./ann_bench --synthetic 100000 --dim 256 --clusters 200 --queries 500
+//   ./ann_bench --index artifacts --queries 200 --k 10 --json
+//
+// The only approximate backend so far is the IVF-flat index below; new ones
+// get their own parameter sweep next to it in main().
+
+#define SENTRA_NO_MAIN
+#include "../main.cpp"
+#include "bench_util.hpp"
+
+#include <numeric>
+
+namespace {
+
+using bench::Clock;
+using bench::msSince;
+
+struct Dataset {
+    std::size_t dim = 0;
+    std::vector<std::string> ids;   // row -> doc id
+    std::vector<float> vectors;     // row-major, L2-normalized
+    std::shared_ptr<VectorIndex> index;
+};
+
+struct BenchOptions {
+    std::string indexDir;
+    std::size_t synthetic = 0;
+    std::size_t dim = 256;
+    std::size_t clusters = 100;
+    std::size_t queries = 200;
+    int k = 10;
+    bool json = false;
+    uint32_t seed = 42;
+};
+
+void normalize(float* v, std::size_t dim) {
+    double n = 0.0;
+    for (std::size_t i = 0; i < dim; ++i) n += static_cast<double>(v[i]) * v[i];
+    if (n == 0.0) return;
+    float inv = static_cast<float>(1.0 / std::sqrt(n));
+    for (std::size_t i = 0; i < dim; ++i) v[i] *= inv;
+}
+
+float dot(const float* a, const float* b, std::size_t dim) {
+    float s = 0.0f;
+    for (std::size_t i = 0; i < dim; ++i) s += a[i] * b[i];
+    return s;
+}
+
+Dataset loadDataset(const BenchOptions& opt) {
+    Dataset ds;
+    if (!opt.indexDir.empty()) {
+        ds.index = std::make_shared<VectorIndex>(bench::scratchConfig(opt.indexDir));
+        // read-only: a live writer's .tmp checkpoint files and WAL tail are
+        // left alone (the writer lock is not held here)
+        ds.index->setWritable(false);
+        ds.index->loadFromDisk();
+        ds.index->forEachLive([&](const Document& d, const float* v, std::size_t dim) {
+            ds.dim = dim;
+            ds.ids.push_back(d.id);
+            ds.vectors.insert(ds.vectors.end(), v, v + dim);
+            normalize(ds.vectors.data() + ds.vectors.size() - dim, dim);
+        });
+        if (ds.ids.empty()) throw std::runtime_error("Index is empty: " + opt.indexDir);
+        return ds;
+    }
+
+    // Gaussian blobs around random unit centres
+    std::mt19937 rng(opt.seed);
+    std::normal_distribution<float> gauss(0.0f, 1.0f);
+    ds.dim = opt.dim;
+    std::vector<float> centres(opt.clusters * opt.dim);
+    for (std::size_t c = 0; c < opt.clusters; ++c) {
+        for (std::size_t i = 0; i < opt.dim; ++i) centres[c * opt.dim + i] = gauss(rng);
+        normalize(&centres[c * opt.dim], opt.dim);
+    }
+    std::vector<Document> docs(opt.synthetic);
+    std::vector<std::vector<float>> embs(opt.synthetic, std::vector<float>(opt.dim));
+    std::uniform_int_distribution<std::size_t> pick(0, opt.clusters - 1);
+    float spread = 1.0f / std::sqrt(static_cast<float>(opt.dim));
+    for (std::size_t r = 0; r < opt.synthetic; ++r) {
+        const float* c = &centres[pick(rng) * opt.dim];
+        for (std::size_t i = 0; i < opt.dim; ++i) embs[r][i] = c[i] + spread * gauss(rng);
+        normalize(embs[r].data(), opt.dim);
+        docs[r].id = "doc-" + std::to_string(r);
+        docs[r].sourcePath = "synthetic";
+        docs[r].content = "synthetic vector " + std::to_string(r);
+        ds.ids.push_back(docs[r].id);
+        ds.vectors.insert(ds.vectors.end(), embs[r].begin(), embs[r].end());
+    }
+
+    std::string dir = (fs::temp_directory_path() / "sentra_ann_bench").string();
+    fs::create_directories(dir);
+    ds.index = std::make_shared<VectorIndex>(bench::scratchConfig(dir));
+    ds.index->build(docs, std::move(embs));
+    return ds;
+}
+
+// Queries are stored vectors with noise added, so each has near neighbours.
+std::vector<std::vector<float>> makeQueries(const Dataset& ds, const BenchOptions& opt) {
+    std::mt19937 rng(opt.seed + 1);
+    std::normal_distribution<float> gauss(0.0f, 1.0f);
+    std::uniform_int_distribution<std::size_t> pick(0, ds.ids.size() - 1);
+    float noise = 0.5f / std::sqrt(static_cast<float>(ds.dim));
+    std::vector<std::vector<float>> qs(opt.queries, std::vector<float>(ds.dim));
+    for (auto& q : qs) {
+        const float* base = &ds.vectors[pick(rng) * ds.dim];
+        for (std::size_t i = 0; i < ds.dim; ++i) q[i] = base[i] + noise * gauss(rng);
+        normalize(q.data(), ds.dim);
+    }
+    return qs;
+}
+
+// Inverted-file index with exact (flat) scoring inside each list: k-means
+// centroids partition the vectors, a query scans the nprobe closest lists.
+class IvfFlat {
+public:
+    IvfFlat(const Dataset& ds, std::size_t nlist, uint32_t seed)
+        : dim_(ds.dim), nlist_(std::min(nlist, ds.ids.size())) {
+        std::size_t n = ds.ids.size();
+        std::mt19937 rng(seed);
+
+        // k-means on a sample of at most 64 points per list
+        std::vector<std::size_t> sample(n);
+        std::iota(sample.begin(), sample.end(), 0);
+        std::shuffle(sample.begin(), sample.end(), rng);
+        sample.resize(std::min(n, nlist_ * 64));
+        centroids_.assign(nlist_ * dim_, 0.0f);
+        for (std::size_t c = 0; c < nlist_; ++c) {
+            std::copy_n(&ds.vectors[sample[c] * dim_], dim_, &centroids_[c * dim_]);
+        }
+        std::vector<std::size_t> assign(sample.size());
+        for (int iter = 0; iter < 10; ++iter) {
+            for (std::size_t s = 0; s < sample.size(); ++s) {
+                assign[s] = nearest(&ds.vectors[sample[s] * dim_]);
+            }
+            std::vector<float> sums(nlist_ * dim_, 0.0f);
+            std::vector<std::size_t> counts(nlist_, 0);
+            for (std::size_t s = 0; s < sample.size(); ++s) {
+                const float* v = &ds.vectors[sample[s] * dim_];
+                for (std::size_t i = 0; i < dim_; ++i) sums[assign[s] * dim_ + i] += v[i];
+                ++counts[assign[s]];
+            }
+            for (std::size_t c = 0; c < nlist_; ++c) {
+                if (counts[c] == 0) continue;   // keep the old centroid
+                std::copy_n(&sums[c * dim_], dim_, &centroids_[c * dim_]);
+                normalize(&centroids_[c * dim_], dim_);
+            }
+        }
+
+        // lay the vectors out list by list so a probe reads contiguous memory
+        std::vector<std::vector<uint32_t>> members(nlist_);
+        for (std::size_t r = 0; r < n; ++r) {
+            members[nearest(&ds.vectors[r * dim_])].push_back(static_cast<uint32_t>(r));
+        }
+        offsets_.push_back(0);
+        for (const auto& m : members) {
+            for (uint32_t r : m) {
+                rows_.push_back(r);
+                vectors_.insert(vectors_.end(), &ds.vectors[r * dim_], &ds.vectors[r * dim_] + dim_);
+            }
+            offsets_.push_back(rows_.size());
+        }
+    }
+
+    // top-k dataset rows for a normalized query
+    std::vector<uint32_t> search(const std::vector<float>& q, int k, std::size_t nprobe) const {
+        std::vector<std::pair<float, std::size_t>> lists(nlist_);
+        for (std::size_t c = 0; c < nlist_; ++c) {
+            lists[c] = {dot(q.data(), &centroids_[c * dim_], dim_), c};
+        }
+        nprobe = std::min(nprobe, nlist_);
+        std::partial_sort(lists.begin(), lists.begin() + nprobe, lists.end(),
+                          [](const auto& a, const auto& b) { return a.first > b.first; });
+
+        std::vector<std::pair<float, uint32_t>> hits;
+        for (std::size_t p = 0; p < nprobe; ++p) {
+            std::size_t c = lists[p].second;
+            for (std::size_t j = offsets_[c]; j < offsets_[c + 1]; ++j) {
+                hits.emplace_back(dot(q.data(), &vectors_[j * dim_], dim_), rows_[j]);
+            }
+        }
+        std::size_t top = std::min<std::size_t>(static_cast<std::size_t>(k), hits.size());
+        std::partial_sort(hits.begin(), hits.begin() + top, hits.end(),
+                          [](const auto& a, const auto& b) { return a.first > b.first; });
+        std::vector<uint32_t> out(top);
+        for (std::size_t i = 0; i < top; ++i) out[i] = hits[i].second;
+        return out;
+    }
+
+    std::size_t memoryBytes() const {
+        return (centroids_.size() + vectors_.size()) * sizeof(float) +
+               rows_.size() * sizeof(uint32_t) + offsets_.size() * sizeof(std::size_t);
+    }
+
+private:
+    std::size_t dim_;
+    std::size_t nlist_;
+    std::vector<float> centroids_;
+    std::vector<float> vectors_;
+    std::vector<uint32_t> rows_;
+    std::vector<std::size_t> offsets_;
+
+    std::size_t nearest(const float* v) const {
+        std::size_t best = 0;
+        float bestSim = -2.0f;
+        for (std::size_t c = 0; c < nlist_; ++c) {
+            float s = dot(v, &centroids_[c * dim_], dim_);
+            if (s > bestSim) {
+                bestSim = s;
+                best = c;
+            }
+        }
+        return best;
+    }
+};
+
+struct Result {
+    std::string backend;
+    std::string params;
+    double recall = 0.0;
+    double qps = 0.0;
+    double p50Ms = 0.0;
+    double p99Ms = 0.0;
+    std::size_t memoryBytes = 0;
+    double buildMs = 0.0;
+};
+
+// Run every query through `search` (returning doc ids) and score it
+// against the exact top-k.
+template <typename Search>
+Result measure(const std::vector<std::vector<float>>& queries,
+               const std::vector<std::vector<std::string>>& truth, int k, Search&& search) {
+    Result r;
+    std::vector<double> lat;
+    lat.reserve(queries.size());
+    double hits = 0.0, wanted = 0.0;
+    auto start = Clock::now();
+    for (std::size_t q = 0; q < queries.size(); ++q) {
+        auto t0 = Clock::now();
+        std::vector<std::string> got = search(queries[q]);
+        lat.push_back(msSince(t0));
+        std::sort(got.begin(), got.end());
+        for (const auto& id : truth[q]) {
+            if (std::binary_search(got.begin(), got.end(), id)) ++hits;
+        }
+        wanted += static_cast<double>(std::min<std::size_t>(truth[q].size(), static_cast<std::size_t>(k)));
+    }
+    double total = msSince(start);
+    r.recall = wanted > 0 ? hits / wanted : 1.0;
+    r.qps = total > 0 ? 1000.0 * static_cast<double>(queries.size()) / total : 0.0;
+    r.p50Ms = bench::percentile(lat, 0.50);
+    r.p99Ms = bench::percentile(lat, 0.99);
+    return r;
+}
+
+void printResults(const std::vector<Result>& results, const Dataset& ds, const BenchOptions& opt) {
+    if (opt.json) {
+        json out = json::array();
+        for (const auto& r : results) {
+            out.push_back({{"backend", r.backend}, {"params", r.params},
+                           {"n", ds.ids.size()}, {"dim", ds.dim}, {"k", opt.k},
+                           {"recall", r.recall}, {"qps", r.qps},
+                           {"p50_ms", r.p50Ms}, {"p99_ms", r.p99Ms},
+                           {"memory_bytes", r.memoryBytes}, {"build_ms", r.buildMs}});
+        }
+        std::cout << out.dump(2) << "\n";
+        return;
+    }
+    std::cout << "backend,params,n,dim,k,recall,qps,p50_ms,p99_ms,memory_bytes,build_ms\n";
+    for (const auto& r : results) {
+        std::cout << r.backend << ',' << r.params << ',' << ds.ids.size() << ',' << ds.dim << ','
+                  << opt.k << ',' << r.recall << ',' << r.qps << ',' << r.p50Ms << ','
+                  << r.p99Ms << ',' << r.memoryBytes << ',' << r.buildMs << '\n';
+    }
+}
+
+BenchOptions parseArgs(int argc, char** argv) {
+    BenchOptions opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg);
+            return argv[++i];
+        };
+        if (arg == "--index") opt.indexDir = value();
+        else if (arg == "--synthetic") opt.synthetic = std::stoul(value());
+        else if (arg == "--dim") opt.dim = std::stoul(value());
+        else if (arg == "--clusters") opt.clusters = std::stoul(value());
+        else if (arg == "--queries") opt.queries = std::stoul(value());
+        else if (arg == "--k") opt.k = std::stoi(value());
+        else if (arg == "--seed") opt.seed = static_cast<uint32_t>(std::stoul(value()));
+        else if (arg == "--json") opt.json = true;
+        else throw std::runtime_error("Unknown argument: " + arg);
+    }
+    if (opt.indexDir.empty() && opt.synthetic == 0) opt.synthetic = 50000;
+    if (opt.clusters == 0 || opt.dim == 0 || opt.k <= 0) {
+        throw std::runtime_error("--clusters, --dim and --k must be positive");
+    }
+    return opt;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    try {
+        BenchOptions opt = parseArgs(argc, argv);
+        Dataset ds = loadDataset(opt);
+        auto queries = makeQueries(ds, opt);
+        std::cerr << "Dataset: " << ds.ids.size() << " vectors, dim " << ds.dim
+                  << ", " << queries.size() << " queries.\n";
+
+        // exact baseline; its results are the ground truth
+        std::vector<std::vector<std::string>> truth;
+        for (const auto& q : queries) {
+            std::vector<std::string> ids;
+            for (const auto& hit : ds.index->search(q, opt.k)) ids.emplace_back(hit.id());
+            truth.push_back(std::move(ids));
+        }
+
+        std::vector<Result> results;
+        Result exact = measure(queries, truth, opt.k, [&](const std::vector<float>& q) {
+            std::vector<std::string> ids;
+            for (const auto& hit : ds.index->search(q, opt.k)) ids.emplace_back(hit.id());
+            return ids;
+        });
+        exact.backend = "exact";
+        exact.params = "-";
+        exact.memoryBytes = ds.ids.size() * (ds.dim + 1) * sizeof(float);
+        results.push_back(exact);
+
+        // IVF-flat sweep: list counts around sqrt(n), probes up to a quarter
+        std::size_t root = static_cast<std::size_t>(std::sqrt(static_cast<double>(ds.ids.size())));
+        for (std::size_t nlist : {std::max<std::size_t>(root / 2, 1), std::max<std::size_t>(root, 1),
+                                  std::max<std::size_t>(root * 2, 1)}) {
+            auto t0 = Clock::now();
+            IvfFlat ivf(ds, nlist, opt.seed);
+            double buildMs = msSince(t0);
+            for (std::size_t nprobe : {1, 2, 4, 8, 16, 32, 64}) {
+                if (nprobe > nlist / 4 && nprobe != 1) break;
+                Result r = measure(queries, truth, opt.k, [&](const std::vector<float>& q) {
+                    std::vector<std::string> ids;
+                    for (uint32_t row : ivf.search(q, opt.k, nprobe)) ids.push_back(ds.ids[row]);
+                    return ids;
+                });
+                r.backend = "ivf_flat";
+                r.params = "nlist=" + std::to_string(nlist) + ";nprobe=" + std::to_string(nprobe);
+                r.memoryBytes = ivf.memoryBytes();
+                r.buildMs = buildMs;
+                results.push_back(r);
+            }
+        }
+
+        printResults(results, ds, opt);
+        return 0;
+    } catch (const std::exception& ex) {
+        std::cerr << "Fatal error: " << ex.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,230 @@
+// Helpers shared by the benchmarks in bench/. Include after main.cpp.
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace bench {
+
+using Clock = std::chrono::steady_clock;
+
+inline double msSince(Clock::time_point t0) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+}
+
+// Nearest-rank percentile, p in [0, 1].
+inline double percentile(std::vector<double> v, double p) {
+    if (v.empty()) return 0.0;
+    std::sort(v.begin(), v.end());
+    std::size_t i = static_cast<std::size_t>(p * static_cast<double>(v.size() - 1) + 0.5);
+    return v[std::min(i, v.size() - 1)];
+}
+
+// A config whose files all live in `dir`, so benchmarks never touch the
+// real artifacts.
+inline SentraConfig scratchConfig(const std::string& dir) {
+    SentraConfig cfg;
+    cfg.artifactsDir = dir;
+    cfg.indexPath    = dir + "/index.bin";
+    cfg.metaPath     = dir + "/metadata.json";
+    cfg.walPath      = dir + "/index.wal";
+    cfg.lockPath     = dir + "/index.lock";
+    cfg.lexicalPath  = dir + "/lexical.bin";
+    return cfg;
+}
+
+// Comma-separated list of numbers, e.g. "1000,10000,100000".
+inline std::vector<std::size_t> parseSizes(const std::string& list) {
+    std::vector<std::size_t> out;
+    std::size_t pos = 0;
+    while (pos < list.size()) {
+        std::size_t comma = list.find(',', pos);
+        if (comma == std::string::npos) comma = list.size();
+        out.push_back(static_cast<std::size_t>(std::stod(list.substr(pos, comma - pos))));
+        pos = comma + 1;
+    }
+    return out;
+}
+
+// High-dynamic-range histogram of microsecond values, 1 us to about an
+// hour, with three significant digits: values below 2048 get their own
+// bucket, larger ones share a power-of-two range split into 1024 steps.
+// Recording is one increment, so each thread keeps its own histogram and
+// they are merged at the end.
+class HdrHistogram {
+public:
+    HdrHistogram() : counts_(kBuckets, 0) {}
+
+    void record(int64_t us) {
+        if (us < 0) us = 0;
+        if (us > kMaxValue) us = kMaxValue;
+        ++counts_[indexOf(static_cast<uint64_t>(us))];
+        ++total_;
+        sum_ += static_cast<double>(us);
+        max_ = std::max(max_, us);
+    }
+
+    void recordMs(double ms) {
+        record(static_cast<int64_t>(ms * 1000.0 + 0.5));
+    }
+
+    void merge(const HdrHistogram& other) {
+        for (std::size_t i = 0; i < kBuckets; ++i) counts_[i] += other.counts_[i];
+        total_ += other.total_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    uint64_t count() const { return total_; }
+    double meanMs() const { return total_ ? sum_ / static_cast<double>(total_) / 1000.0 : 0.0; }
+    double maxMs() const { return static_cast<double>(max_) / 1000.0; }
+
+    // Value at percentile p in [0, 100], in milliseconds (upper edge of
+    // the bucket it falls in, capped at the largest value recorded).
+    double percentileMs(double p) const {
+        if (total_ == 0) return 0.0;
+        uint64_t rank = static_cast<uint64_t>(p / 100.0 * static_cast<double>(total_) + 0.5);
+        rank = std::max<uint64_t>(1, std::min(rank, total_));
+        uint64_t seen = 0;
+        for (std::size_t i = 0; i < kBuckets; ++i) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                return static_cast<double>(std::min<int64_t>(upperOf(i), max_)) / 1000.0;
+            }
+        }
+        return maxMs();
+    }
+
+private:
+    static constexpr int kSubBits = 11;                         // 2048 sub-buckets
+    static constexpr uint64_t kHalf = uint64_t{1} << (kSubBits - 1);
+    static constexpr int64_t kMaxValue = int64_t{1} << 32;      // ~71 minutes in us
+    static constexpr std::size_t kBuckets = (32 - kSubBits + 2) * kHalf + kHalf;
+
+    std::vector<uint64_t> counts_;
+    uint64_t total_ = 0;
+    double sum_ = 0.0;
+    int64_t max_ = 0;
+
+    static std::size_t indexOf(uint64_t v) {
+        int bits = 0;
+        for (uint64_t x = v; x; x >>= 1) ++bits;
+        int shift = std::max(0, bits - kSubBits);
+        return static_cast<std::size_t>(shift) * kHalf + static_cast<std::size_t>(v >> shift);
+    }
+
+    static int64_t upperOf(std::size_t index) {
+        std::size_t shift = index < 2 * kHalf ? 0 : (index - kHalf) / kHalf;
+        uint64_t sub = index - shift * kHalf;
+        return static_cast<int64_t>(((sub + 1) << shift) - 1);
+    }
+};
+
+// Hardware counters (cycles, instructions, LLC misses, dTLB load misses)
+// for the calling thread and the threads it starts afterwards, through
+// Linux perf_event_open. Only user space is counted, so the default
+// perf_event_paranoid level of 2 is enough. A counter the kernel refuses
+// (VMs, containers, stricter paranoid settings) or any counter on another
+// OS reads as unavailable.
+class PerfCounters {
+public:
+    enum Counter { Cycles, Instructions, LlcMisses, DtlbMisses, kCount };
+
+    struct Reading {
+        double value[kCount] = {};
+        bool valid[kCount] = {};
+    };
+
+    PerfCounters() {
+#ifdef __linux__
+        const uint64_t dtlbLoadMiss = PERF_COUNT_HW_CACHE_DTLB |
+                                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        const std::pair<uint32_t, uint64_t> events[kCount] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+            {PERF_TYPE_HW_CACHE, dtlbLoadMiss},
+        };
+        for (int c = 0; c < kCount; ++c) {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = events[c].first;
+            attr.config = events[c].second;
+            attr.disabled = 1;
+            attr.inherit = 1;          // include search threads started later
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds_[c] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+#endif
+    }
+
+    ~PerfCounters() {
+#ifdef __linux__
+        for (int fd : fds_) {
+            if (fd >= 0) close(fd);
+        }
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    static const char* name(int c) {
+        static const char* const names[kCount] = {"cycles", "instructions", "llc_misses", "dtlb_misses"};
+        return names[c];
+    }
+
+    bool any() const {
+        for (int fd : fds_) {
+            if (fd >= 0) return true;
+        }
+        return false;
+    }
+
+    void start() {
+#ifdef __linux__
+        for (int fd : fds_) {
+            if (fd < 0) continue;
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    // Counts since start(), scaled up when the kernel multiplexed a counter.
+    Reading stop() {
+        Reading r;
+#ifdef __linux__
+        for (int c = 0; c < kCount; ++c) {
+            if (fds_[c] < 0) continue;
+            ioctl(fds_[c], PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t buf[3] = {};   // value, time enabled, time running
+            if (read(fds_[c], buf, sizeof(buf)) != static_cast<ssize_t>(sizeof(buf)) || buf[2] == 0) {
+                continue;
+            }
+            r.value[c] = static_cast<double>(buf[0]) * static_cast<double>(buf[1]) /
+                         static_cast<double>(buf[2]);
+            r.valid[c] = true;
+        }
+#endif
+        return r;
+    }
+
+private:
+    int fds_[kCount] = {-1, -1, -1, -1};
+};
+
+}  // namespace bench
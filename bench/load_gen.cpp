@@ -0,0 +1,303 @@
+// End-to-end load generator for SentraEngine::answer.
+//
+// Replays a question file (one question per line, cycled) against an
+// engine loaded read-only from artifacts/ (built beforehand with
+// ./sentra --sync; nothing there is ever written), either open-loop at a fixed arrival rate or
+// closed-loop with a fixed number of concurrent clients, and records an HDR
+// histogram per stage (embed, semantic, keyword, retrieve, context, chat,
+// total). Point --base-url at a local OpenAI-compatible stub to get
+// reproducible numbers offline, or --record a run against the real API and
+// --replay it later (with --replay-latency none, only local CPU cost is left).
+//
+//   g++ -std=c++17 -O2 -pthread bench/load_gen.cpp -o load_gen
+//   ./load_gen --questions questions.txt --mode open --rate 20 --duration 60 --base-url http://127.0.0.1:8089/v1
+//   ./load_gen --questions questions.txt --mode closed --concurrency 8 --requests 2000 --json
+//   ./load_gen --questions questions.txt --mode closed --concurrency 1 --requests 200 --record trace.cas
+//   ./load_gen --questions questions.txt --mode closed --concurrency 1 --requests 200 --replay trace.cas --replay-latency none
+//
+// Open-loop latency is measured from each request's scheduled start, so a
+// backlog shows up in the tail instead of silently lowering the offered
+// rate (coordinated omission).
+//
+// Built with -DSENTRA_ALLOC_PROFILE, the report adds heap allocations and
+// bytes per query for each stage.
+
+#define SENTRA_NO_MAIN
+#include "../main.cpp"
+#include "bench_util.hpp"
+
+namespace {
+
+struct LoadOptions {
+    std::string questionsPath;
+    std::string mode = "closed";     // "open" or "closed"
+    double rate = 10.0;              // open loop: requests per second
+    int concurrency = 4;             // closed loop: clients
+    int maxInFlight = 64;            // open loop: worker threads
+    std::size_t requests = 0;        // stop after this many (0: use duration)
+    double durationS = 30.0;
+    std::size_t warmup = 10;         // requests not recorded
+    std::string baseUrl;
+    std::string cassetteMode;        // "record" or "replay"
+    std::string cassettePath;
+    std::string replayLatency = "original";
+    std::string tracePath;
+    bool json = false;
+};
+
+const char* const kStages[] = {"embed", "semantic", "keyword", "retrieve", "context", "chat", "total"};
+constexpr std::size_t kStageCount = sizeof(kStages) / sizeof(kStages[0]);
+
+struct Recorder {
+    bench::HdrHistogram stages[kStageCount];
+    uint64_t errors = 0;
+    uint64_t offTopic = 0;
+    uint64_t promptTokens = 0, completionTokens = 0, cachedTokens = 0;
+    double costUsd = 0.0;
+    AllocCount allocs[kStageCount];   // summed over recorded queries
+
+    void add(const AnswerStats& s, double totalMs) {
+        const double values[kStageCount] = {s.embedMs, s.semanticMs, s.keywordMs, s.retrieveMs,
+                                            s.contextMs, s.chatMs, totalMs};
+        for (std::size_t i = 0; i < kStageCount; ++i) stages[i].recordMs(values[i]);
+        if (s.offTopic) ++offTopic;
+        for (const TokenUsage* u : {&s.embedUsage, &s.chatUsage}) {
+            promptTokens += u->promptTokens;
+            completionTokens += u->completionTokens;
+            cachedTokens += u->cachedTokens;
+        }
+        costUsd += s.costUsd;
+        // kStages follows EngineMetrics::Stage from Embed to Total
+        for (std::size_t i = 0; i < kStageCount; ++i) allocs[i] += s.allocs[i];
+    }
+};
+
+std::vector<std::string> readQuestions(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) throw std::runtime_error("Failed to open questions file: " + path);
+    std::vector<std::string> qs;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty()) qs.push_back(line);
+    }
+    if (qs.empty()) throw std::runtime_error("No questions in " + path);
+    return qs;
+}
+
+LoadOptions parseArgs(int argc, char** argv) {
+    LoadOptions opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg);
+            return argv[++i];
+        };
+        if (arg == "--questions") opt.questionsPath = value();
+        else if (arg == "--mode") opt.mode = value();
+        else if (arg == "--rate") opt.rate = std::stod(value());
+        else if (arg == "--concurrency") opt.concurrency = std::stoi(value());
+        else if (arg == "--max-in-flight") opt.maxInFlight = std::stoi(value());
+        else if (arg == "--requests") opt.requests = std::stoul(value());
+        else if (arg == "--duration") opt.durationS = std::stod(value());
+        else if (arg == "--warmup") opt.warmup = std::stoul(value());
+        else if (arg == "--base-url") opt.baseUrl = value();
+        else if (arg == "--record" || arg == "--replay") {
+            opt.cassetteMode = arg.substr(2);
+            opt.cassettePath = value();
+        }
+        else if (arg == "--replay-latency") opt.replayLatency = value();
+        else if (arg == "--trace") opt.tracePath = value();
+        else if (arg == "--json") opt.json = true;
+        else throw std::runtime_error("Unknown argument: " + arg);
+    }
+    if (opt.questionsPath.empty()) throw std::runtime_error("--questions is required");
+    if (opt.mode != "open" && opt.mode != "closed") {
+        throw std::runtime_error("--mode must be open or closed");
+    }
+    if (opt.replayLatency != "original" && opt.replayLatency != "none") {
+        throw std::runtime_error("--replay-latency must be original or none");
+    }
+    if (opt.rate <= 0 || opt.concurrency <= 0 || opt.maxInFlight <= 0) {
+        throw std::runtime_error("--rate, --concurrency and --max-in-flight must be positive");
+    }
+    return opt;
+}
+
+// Runs the load. Workers share one Recorder under a mutex: a request takes
+// milliseconds, so the lock is never contended enough to matter, and open
+// loop can use hundreds of workers without a histogram set each.
+class LoadRunner {
+public:
+    LoadRunner(SentraEngine& engine, const std::vector<std::string>& questions, const LoadOptions& opt)
+        : engine_(engine), questions_(questions), opt_(opt) {}
+
+    const Recorder& run(double& elapsedS, uint64_t& completed) {
+        // warmup requests run first, sequentially, and are not recorded
+        for (std::size_t i = 0; i < opt_.warmup; ++i) {
+            try {
+                engine_.answer(questions_[i % questions_.size()]);
+            } catch (const std::exception&) {
+            }
+        }
+
+        int workers = opt_.mode == "open" ? opt_.maxInFlight : opt_.concurrency;
+        start_ = bench::Clock::now();
+        deadline_ = start_ + std::chrono::duration_cast<bench::Clock::duration>(
+                                 std::chrono::duration<double>(opt_.durationS));
+        std::vector<std::thread> threads;
+        for (int w = 0; w < workers; ++w) {
+            threads.emplace_back([this]() { work(); });
+        }
+        for (auto& t : threads) t.join();
+        elapsedS = bench::msSince(start_) / 1000.0;
+        completed = completed_.load();
+        return rec_;
+    }
+
+private:
+    SentraEngine& engine_;
+    const std::vector<std::string>& questions_;
+    const LoadOptions& opt_;
+    bench::Clock::time_point start_, deadline_;
+    std::atomic<uint64_t> next_{0};
+    std::atomic<uint64_t> completed_{0};
+    std::mutex recMu_;
+    Recorder rec_;
+
+    bool done(uint64_t i, bench::Clock::time_point at) const {
+        if (opt_.requests > 0) return i >= opt_.requests;
+        return at >= deadline_;
+    }
+
+    void work() {
+        while (true) {
+            uint64_t i = next_.fetch_add(1);
+            bench::Clock::time_point begin;
+            if (opt_.mode == "open") {
+                // request i is due at start + i / rate whether or not the
+                // previous ones have finished
+                begin = start_ + std::chrono::duration_cast<bench::Clock::duration>(
+                                     std::chrono::duration<double>(static_cast<double>(i) / opt_.rate));
+                if (done(i, begin)) return;
+                std::this_thread::sleep_until(begin);
+            } else {
+                begin = bench::Clock::now();
+                if (done(i, begin)) return;
+            }
+
+            AnswerStats stats;
+            try {
+                engine_.answer(questions_[i % questions_.size()], {}, &stats);
+                double totalMs = bench::msSince(begin);
+                std::lock_guard<std::mutex> lock(recMu_);
+                rec_.add(stats, totalMs);
+                completed_.fetch_add(1);
+            } catch (const std::exception& ex) {
+                std::lock_guard<std::mutex> lock(recMu_);
+                if (rec_.errors++ == 0) std::cerr << "[WARN] Request failed: " << ex.what() << "\n";
+            }
+        }
+    }
+};
+
+double perQuery(uint64_t total, uint64_t queries) {
+    return queries ? static_cast<double>(total) / static_cast<double>(queries) : 0.0;
+}
+
+void printReport(const Recorder& rec, const LoadOptions& opt, double elapsedS, uint64_t completed) {
+    double throughput = elapsedS > 0 ? static_cast<double>(completed) / elapsedS : 0.0;
+    if (opt.json) {
+        json stages = json::object();
+        for (std::size_t i = 0; i < kStageCount; ++i) {
+            const auto& h = rec.stages[i];
+            stages[kStages[i]] = {{"count", h.count()}, {"mean_ms", h.meanMs()},
+                                  {"p50_ms", h.percentileMs(50)}, {"p90_ms", h.percentileMs(90)},
+                                  {"p99_ms", h.percentileMs(99)}, {"p999_ms", h.percentileMs(99.9)},
+                                  {"max_ms", h.maxMs()}};
+            if (kAllocProfiling) {
+                stages[kStages[i]]["allocs_per_query"] = perQuery(rec.allocs[i].allocs, completed);
+                stages[kStages[i]]["alloc_bytes_per_query"] = perQuery(rec.allocs[i].bytes, completed);
+            }
+        }
+        json out = {{"mode", opt.mode}, {"offered_rate", opt.mode == "open" ? opt.rate : 0.0},
+                    {"concurrency", opt.mode == "closed" ? opt.concurrency : 0},
+                    {"elapsed_s", elapsedS}, {"completed", completed},
+                    {"errors", rec.errors}, {"off_topic", rec.offTopic},
+                    {"throughput_rps", throughput},
+                    {"tokens", {{"prompt", rec.promptTokens}, {"completion", rec.completionTokens},
+                                {"cached", rec.cachedTokens}}},
+                    {"cost_usd", rec.costUsd}, {"stages", stages}};
+        std::cout << out.dump(2) << "\n";
+        return;
+    }
+    std::cout << "mode=" << opt.mode << " completed=" << completed << " errors=" << rec.errors
+              << " off_topic=" << rec.offTopic << " elapsed_s=" << elapsedS
+              << " throughput_rps=" << throughput << "\n";
+    std::cout << "prompt_tokens=" << rec.promptTokens << " completion_tokens=" << rec.completionTokens
+              << " cached_tokens=" << rec.cachedTokens << " cost_usd=" << rec.costUsd << "\n";
+    std::cout << "stage,count,mean_ms,p50_ms,p90_ms,p99_ms,p999_ms,max_ms"
+              << (kAllocProfiling ? ",allocs_per_query,alloc_bytes_per_query\n" : "\n");
+    for (std::size_t i = 0; i < kStageCount; ++i) {
+        const auto& h = rec.stages[i];
+        std::cout << kStages[i] << ',' << h.count() << ',' << h.meanMs() << ','
+                  << h.percentileMs(50) << ',' << h.percentileMs(90) << ','
+                  << h.percentileMs(99) << ',' << h.percentileMs(99.9) << ',' << h.maxMs();
+        if (kAllocProfiling) {
+            std::cout << ',' << perQuery(rec.allocs[i].allocs, completed) << ','
+                      << perQuery(rec.allocs[i].bytes, completed);
+        }
+        std::cout << '\n';
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    try {
+        LoadOptions opt = parseArgs(argc, argv);
+        auto questions = readQuestions(opt.questionsPath);
+
+        SentraConfig cfg;
+        if (fs::exists("api_key.txt")) {
+            cfg = loadConfig();
+        } else if (!opt.baseUrl.empty() || opt.cassetteMode == "replay") {
+            cfg.apiKey = "stub";   // a local stub or a replay does not check the key
+        } else {
+            throw std::runtime_error("Create api_key.txt, or pass --base-url or --replay.");
+        }
+        if (!opt.baseUrl.empty()) cfg.baseUrl = opt.baseUrl;
+        if (!opt.cassetteMode.empty()) {
+            cfg.httpCassetteMode = opt.cassetteMode;
+            cfg.httpCassettePath = opt.cassettePath;
+        }
+        cfg.replayLatency = opt.replayLatency;
+
+        // The index is only read: the engine loads it the way a query
+        // process does (no sync, no writer lock, no WAL repair), so a run
+        // against a stub can never put stub vectors into artifacts/, and the
+        // disk state it records keeps the first query from reloading. Only
+        // the HTTP client's request scratch files move to a temp directory.
+        SentraConfig httpCfg = cfg;
+        httpCfg.artifactsDir = (fs::temp_directory_path() / "sentra_load_gen").string();
+
+        std::unique_ptr<Tracer> tracer;
+        if (!opt.tracePath.empty()) tracer = std::make_unique<Tracer>(opt.tracePath);
+        HttpClient http(httpCfg);
+        LlmClient llm(cfg, http);
+        SentraEngine engine(cfg, llm, std::make_shared<VectorIndex>(cfg));
+        if (!engine.currentIndex()->existsOnDisk()) {
+            throw std::runtime_error("No index in " + cfg.artifactsDir + "; build it with ./sentra --sync.");
+        }
+        engine.buildOrLoadIndex();
+
+        LoadRunner runner(engine, questions, opt);
+        double elapsedS = 0.0;
+        uint64_t completed = 0;
+        const Recorder& rec = runner.run(elapsedS, completed);
+        printReport(rec, opt, elapsedS, completed);
+        return 0;
+    } catch (const std::exception& ex) {
+        std::cerr << "Fatal error: " << ex.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,386 @@
+// Microbenchmarks for the engine's hot paths: cosineSim, VectorIndex::search,
+// saveToDisk, loadFromDisk, loadDocuments chunking, context assembly and
+// embedding-response parsing.
+//
+// Every case runs warmup repetitions, then --reps timed repetitions of
+// enough iterations to last --min-rep-ms each, and reports the per-operation
+// median, mean, min, max and standard deviation. Output is CSV (default) or
+// JSON, so runs from two builds can be diffed.
+//
+//   g++ -std=c++17 -O2 -pthread bench/micro_bench.cpp -o micro_bench
+//   ./micro_bench --sizes 1000,100000,1000000 --dims 384,1536 --json > before.json
+//
+// Corpora are synthetic. Cases that would need more than --max-gb of
+// memory are skipped; 10M vectors at dim 1536 needs about 60 GB per copy.
+//
+// --perf adds Linux hardware counters (cycles, instructions, LLC and dTLB
+// misses) per operation and, for search, per vector scanned, plus the DRAM
+// bandwidth implied by the LLC misses (64 bytes each; prefetches are not
+// counted, so it is a lower bound).
+//
+// Built with -DSENTRA_ALLOC_PROFILE, every case also reports heap
+// allocations and bytes per operation.
+
+#define SENTRA_NO_MAIN
+#include "../main.cpp"
+#include "bench_util.hpp"
+
+namespace {
+
+struct MicroOptions {
+    std::vector<std::size_t> sizes = {1000, 10000, 100000};
+    std::vector<std::size_t> dims  = {384, 768, 1536};
+    int warmup = 2;
+    int reps = 10;
+    double minRepMs = 20.0;
+    double maxGb = 4.0;
+    std::string only;   // run cases whose name contains this
+    bool json = false;
+    bool perf = false;
+    uint32_t seed = 7;
+};
+
+struct CaseResult {
+    std::string name;
+    std::size_t size = 0;
+    std::size_t dim = 0;
+    int reps = 0;
+    std::size_t iters = 0;   // operations per repetition
+    double medianNs = 0.0, meanNs = 0.0, minNs = 0.0, maxNs = 0.0, stddevNs = 0.0;
+    // --perf: counter totals per operation; vectors scanned per operation
+    bench::PerfCounters::Reading perOpCounters{};
+    double vectorsPerOp = 0.0;
+    // -DSENTRA_ALLOC_PROFILE: heap allocations and bytes per operation
+    double allocsPerOp = 0.0, allocBytesPerOp = 0.0;
+};
+
+std::vector<CaseResult> results;
+std::unique_ptr<bench::PerfCounters> perf;   // set by --perf
+
+// Time `op` (one operation per call). The iteration count is calibrated
+// from a single call so that a repetition lasts about minRepMs. Counters,
+// if on, span all timed repetitions.
+template <typename Op>
+void runCase(const MicroOptions& opt, const std::string& name, std::size_t size,
+             std::size_t dim, Op&& op, double vectorsPerOp = 0.0) {
+    auto t0 = bench::Clock::now();
+    op();
+    double onceMs = std::max(bench::msSince(t0), 1e-6);
+    std::size_t iters = std::max<std::size_t>(1, static_cast<std::size_t>(opt.minRepMs / onceMs));
+
+    for (int w = 0; w < opt.warmup; ++w) {
+        for (std::size_t i = 0; i < iters; ++i) op();
+    }
+    std::vector<double> perOp;
+    AllocCount allocsBefore = processAllocs();
+    if (perf) perf->start();
+    for (int r = 0; r < opt.reps; ++r) {
+        auto start = bench::Clock::now();
+        for (std::size_t i = 0; i < iters; ++i) op();
+        perOp.push_back(bench::msSince(start) * 1e6 / static_cast<double>(iters));
+    }
+
+    CaseResult c{name, size, dim, opt.reps, iters};
+    if (kAllocProfiling) {
+        AllocCount allocsAfter = processAllocs();
+        double ops = static_cast<double>(iters) * opt.reps;
+        c.allocsPerOp = static_cast<double>(allocsAfter.allocs - allocsBefore.allocs) / ops;
+        c.allocBytesPerOp = static_cast<double>(allocsAfter.bytes - allocsBefore.bytes) / ops;
+    }
+    if (perf) {
+        c.perOpCounters = perf->stop();
+        for (double& v : c.perOpCounters.value) v /= static_cast<double>(iters) * opt.reps;
+        c.vectorsPerOp = vectorsPerOp;
+    }
+    c.medianNs = bench::percentile(perOp, 0.5);
+    c.minNs = *std::min_element(perOp.begin(), perOp.end());
+    c.maxNs = *std::max_element(perOp.begin(), perOp.end());
+    double sum = 0.0, sq = 0.0;
+    for (double v : perOp) sum += v;
+    c.meanNs = sum / static_cast<double>(perOp.size());
+    for (double v : perOp) sq += (v - c.meanNs) * (v - c.meanNs);
+    c.stddevNs = std::sqrt(sq / static_cast<double>(perOp.size()));
+    std::cerr << name << " size=" << size << " dim=" << dim << ": median "
+              << c.medianNs / 1e3 << " us/op\n";
+    results.push_back(c);
+}
+
+bool wanted(const MicroOptions& opt, const std::string& name) {
+    return opt.only.empty() || name.find(opt.only) != std::string::npos;
+}
+
+// Synthetic corpus: random vectors and short, distinct chunk texts.
+void makeCorpus(std::size_t n, std::size_t dim, uint32_t seed,
+                std::vector<Document>& docs, std::vector<std::vector<float>>& embs) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> gauss(0.0f, 1.0f);
+    docs.assign(n, Document{});
+    embs.assign(n, std::vector<float>(dim));
+    for (std::size_t i = 0; i < n; ++i) {
+        docs[i].id = "doc-" + std::to_string(i);
+        docs[i].sourcePath = "data/file" + std::to_string(i / 1000) + ".txt";
+        docs[i].content = "Synthetic chunk " + std::to_string(i) +
+                          " about pumps, valves and maintenance schedules.";
+        for (auto& v : embs[i]) v = gauss(rng);
+    }
+}
+
+void benchCosine(const MicroOptions& opt) {
+    if (!wanted(opt, "cosine_sim")) return;
+    std::mt19937 rng(opt.seed);
+    std::normal_distribution<float> gauss(0.0f, 1.0f);
+    for (std::size_t dim : opt.dims) {
+        const std::size_t rows = 1024;
+        std::vector<float> data(rows * dim), norms(rows);
+        for (auto& v : data) v = gauss(rng);
+        for (std::size_t r = 0; r < rows; ++r) {
+            double n = 0.0;
+            for (std::size_t i = 0; i < dim; ++i) n += data[r * dim + i] * data[r * dim + i];
+            norms[r] = static_cast<float>(std::sqrt(n));
+        }
+        std::size_t r = 0;
+        volatile float sink = 0.0f;
+        runCase(opt, "cosine_sim", 1, dim, [&]() {
+            std::size_t a = r++ % rows, b = (a + 1) % rows;
+            sink = sink + VectorIndex::cosineSim(&data[a * dim], norms[a], &data[b * dim], norms[b], dim);
+        });
+    }
+}
+
+void benchIndex(const MicroOptions& opt) {
+    bool search = wanted(opt, "search"), save = wanted(opt, "save_to_disk"),
+         load = wanted(opt, "load_from_disk");
+    if (!search && !save && !load) return;
+
+    std::string dir = (fs::temp_directory_path() / "sentra_micro_bench").string();
+    for (std::size_t n : opt.sizes) {
+        for (std::size_t dim : opt.dims) {
+            // the corpus copy plus the index's own copy
+            double gb = 2.0 * static_cast<double>(n) * static_cast<double>(dim) * sizeof(float) / 1e9;
+            if (gb > opt.maxGb) {
+                std::cerr << "Skipping index cases at size=" << n << " dim=" << dim
+                          << " (needs ~" << gb << " GB, --max-gb " << opt.maxGb << ")\n";
+                continue;
+            }
+            fs::remove_all(dir);
+            fs::create_directories(dir);
+            SentraConfig cfg = bench::scratchConfig(dir);
+
+            std::vector<Document> docs;
+            std::vector<std::vector<float>> embs;
+            makeCorpus(n, dim, opt.seed, docs, embs);
+            std::vector<float> q = embs[n / 2];
+            VectorIndex index(cfg);
+            index.setWritable(true);
+            index.build(docs, std::move(embs));
+            docs.clear();
+
+            if (search) {
+                volatile std::size_t sink = 0;
+                runCase(opt, "search", n, dim, [&]() { sink = sink + index.search(q, 10).size(); },
+                        static_cast<double>(n));
+            }
+            if (save) {
+                runCase(opt, "save_to_disk", n, dim, [&]() { index.saveToDisk(); });
+            } else if (load) {
+                index.saveToDisk();
+            }
+            if (load) {
+                runCase(opt, "load_from_disk", n, dim, [&]() {
+                    VectorIndex fresh(cfg);
+                    fresh.loadFromDisk();
+                });
+            }
+        }
+    }
+    fs::remove_all(dir);
+}
+
+void benchLoadDocuments(const MicroOptions& opt) {
+    if (!wanted(opt, "load_documents")) return;
+    std::string dir = (fs::temp_directory_path() / "sentra_micro_docs").string();
+    for (std::size_t n : opt.sizes) {
+        // ~300 bytes per chunk, so skip what would not fit in memory
+        if (static_cast<double>(n) * 300.0 / 1e9 > opt.maxGb) continue;
+        fs::remove_all(dir);
+        fs::create_directories(dir);
+        const std::size_t perFile = 1000;
+        for (std::size_t f = 0; f * perFile < n; ++f) {
+            std::string text;
+            for (std::size_t i = f * perFile; i < std::min(n, (f + 1) * perFile); ++i) {
+                text += "Paragraph " + std::to_string(i) +
+                        ": routine inspection of the pump housing, seals and bearings should "
+                        "follow the schedule in section 4, and any leaks must be reported to "
+                        "maintenance before the unit is restarted.\n\n";
+            }
+            writeStringToFile(dir + "/file" + std::to_string(f) + ".txt", text);
+        }
+        volatile std::size_t sink = 0;
+        runCase(opt, "load_documents", n, 0, [&]() { sink = sink + loadDocuments(dir).size(); });
+    }
+    fs::remove_all(dir);
+}
+
+void benchContext(const MicroOptions& opt) {
+    if (!wanted(opt, "build_context")) return;
+    for (std::size_t k : {3, 10}) {
+        std::vector<Document> docs(k);
+        for (std::size_t i = 0; i < k; ++i) {
+            docs[i].sourcePath = "data/manual" + std::to_string(i) + ".txt";
+            docs[i].content = std::string(1200, 'a' + static_cast<char>(i % 26));
+        }
+        std::vector<Candidate> hits(k);
+        for (std::size_t i = 0; i < k; ++i) hits[i].doc = &docs[i];
+        volatile std::size_t sink = 0;
+        runCase(opt, "build_context", k, 0, [&]() { sink = sink + buildContext(hits).size(); });
+    }
+}
+
+// A batched /embeddings response as the API sends it: values with about
+// ten significant digits, plus the usual object/index/model/usage fields.
+void benchEmbedParse(const MicroOptions& opt) {
+    if (!wanted(opt, "embed_parse")) return;
+    std::mt19937 rng(opt.seed);
+    std::normal_distribution<double> gauss(0.0, 1.0);
+    for (std::size_t dim : opt.dims) {
+        for (std::size_t batch : {1, 16}) {
+            json resp;
+            resp["object"] = "list";
+            resp["model"] = "text-embedding-3-small";
+            resp["usage"] = {{"prompt_tokens", 8 * batch}, {"total_tokens", 8 * batch}};
+            resp["data"] = json::array();
+            std::ostringstream text;
+            text.precision(10);
+            for (std::size_t b = 0; b < batch; ++b) {
+                text.str("");
+                text << "[";
+                for (std::size_t i = 0; i < dim; ++i) {
+                    text << (i ? "," : "") << gauss(rng) / std::sqrt(static_cast<double>(dim));
+                }
+                text << "]";
+                resp["data"].push_back({{"object", "embedding"}, {"index", b},
+                                        {"embedding", json::parse(text.str())}});
+            }
+            std::string body = resp.dump();
+            EmbeddingResponse parsed;
+            volatile std::size_t sink = 0;
+            runCase(opt, "embed_parse", batch, dim, [&]() {
+                parsed.parse(body);
+                sink = sink + parsed.vectors.size();
+            });
+        }
+    }
+}
+
+// Counter columns derived from one result; NaN where unavailable.
+std::vector<std::pair<std::string, double>> perfColumns(const CaseResult& c) {
+    using PC = bench::PerfCounters;
+    const auto& r = c.perOpCounters;
+    const double na = std::numeric_limits<double>::quiet_NaN();
+    auto get = [&](int k) { return r.valid[k] ? r.value[k] : na; };
+    std::vector<std::pair<std::string, double>> cols;
+    for (int k = 0; k < PC::kCount; ++k) cols.emplace_back(std::string(PC::name(k)) + "_per_op", get(k));
+    cols.emplace_back("ipc", r.valid[PC::Cycles] && r.valid[PC::Instructions] && r.value[PC::Cycles] > 0
+                                 ? r.value[PC::Instructions] / r.value[PC::Cycles] : na);
+    for (int k : {PC::Cycles, PC::LlcMisses, PC::DtlbMisses}) {
+        cols.emplace_back(std::string(PC::name(k)) + "_per_vector",
+                          c.vectorsPerOp > 0 ? get(k) / c.vectorsPerOp : na);
+    }
+    // bytes per ns == GB/s
+    cols.emplace_back("llc_miss_gbs", get(PC::LlcMisses) * 64.0 / c.meanNs);
+    return cols;
+}
+
+void printResults(const MicroOptions& opt) {
+    if (opt.json) {
+        json out = json::array();
+        for (const auto& c : results) {
+            json row = {{"bench", c.name}, {"size", c.size}, {"dim", c.dim},
+                        {"reps", c.reps}, {"iters", c.iters},
+                        {"median_ns", c.medianNs}, {"mean_ns", c.meanNs},
+                        {"min_ns", c.minNs}, {"max_ns", c.maxNs},
+                        {"stddev_ns", c.stddevNs}};
+            if (kAllocProfiling) {
+                row["allocs_per_op"] = c.allocsPerOp;
+                row["alloc_bytes_per_op"] = c.allocBytesPerOp;
+            }
+            if (opt.perf) {
+                json counters = json::object();
+                for (const auto& [key, value] : perfColumns(c)) {
+                    if (!std::isnan(value)) counters[key] = value;
+                }
+                row["perf"] = counters;
+            }
+            out.push_back(row);
+        }
+        std::cout << out.dump(2) << "\n";
+        return;
+    }
+    std::cout << "bench,size,dim,reps,iters,median_ns,mean_ns,min_ns,max_ns,stddev_ns";
+    if (kAllocProfiling) std::cout << ",allocs_per_op,alloc_bytes_per_op";
+    if (opt.perf && !results.empty()) {
+        for (const auto& col : perfColumns(results.front())) std::cout << ',' << col.first;
+    }
+    std::cout << '\n';
+    for (const auto& c : results) {
+        std::cout << c.name << ',' << c.size << ',' << c.dim << ',' << c.reps << ','
+                  << c.iters << ',' << c.medianNs << ',' << c.meanNs << ',' << c.minNs << ','
+                  << c.maxNs << ',' << c.stddevNs;
+        if (kAllocProfiling) std::cout << ',' << c.allocsPerOp << ',' << c.allocBytesPerOp;
+        if (opt.perf) {
+            for (const auto& col : perfColumns(c)) {
+                std::cout << ',';
+                if (!std::isnan(col.second)) std::cout << col.second;
+            }
+        }
+        std::cout << '\n';
+    }
+}
+
+MicroOptions parseArgs(int argc, char** argv) {
+    MicroOptions opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg);
+            return argv[++i];
+        };
+        if (arg == "--sizes") opt.sizes = bench::parseSizes(value());
+        else if (arg == "--dims") opt.dims = bench::parseSizes(value());
+        else if (arg == "--warmup") opt.warmup = std::stoi(value());
+        else if (arg == "--reps") opt.reps = std::stoi(value());
+        else if (arg == "--min-rep-ms") opt.minRepMs = std::stod(value());
+        else if (arg == "--max-gb") opt.maxGb = std::stod(value());
+        else if (arg == "--only") opt.only = value();
+        else if (arg == "--json") opt.json = true;
+        else if (arg == "--perf") opt.perf = true;
+        else throw std::runtime_error("Unknown argument: " + arg);
+    }
+    if (opt.reps <= 0) throw std::runtime_error("--reps must be positive");
+    return opt;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    try {
+        MicroOptions opt = parseArgs(argc, argv);
+        if (opt.perf) {
+            perf = std::make_unique<bench::PerfCounters>();
+            if (!perf->any()) {
+                std::cerr << "[WARN] No hardware counters available (perf_event_open failed); "
+                             "perf columns will be empty\n";
+            }
+        }
+        benchCosine(opt);
+        benchIndex(opt);
+        benchLoadDocuments(opt);
+        benchContext(opt);
+        benchEmbedParse(opt);
+        printResults(opt);
+        return 0;
+    } catch (const std::exception& ex) {
+        std::cerr << "Fatal error: " << ex.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,229 @@
+"""Deterministic OpenAI-compatible stub server for offline benchmarks and tests.
+
+Implements POST /embeddings and POST /chat/completions (also under /v1/),
+with streaming (server-sent events) and non-streaming chat responses.
+Standard library only.
+
+Embeddings are derived from hashes of the input's words: each word maps to a
+fixed pseudo-random unit vector and a text's embedding is the normalized sum,
+so the same text always gets the same vector and texts sharing words are
+similar. Chat completions are canned and depend only on the request.
+
+    python3 bench/stub_llm_server.py --port 8089 --dim 1536 \
+        --embed-latency-ms 20 --chat-latency-ms 300 --jitter-ms 10 --error-rate 0.01
+
+    SENTRA_BASE_URL=http://127.0.0.1:8089/v1 ./sentra
+"""
+
+import argparse
+import hashlib
+import json
+import math
+import random
+import re
+import struct
+import threading
+import time
+from functools import lru_cache
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+WORD_RE = re.compile(r"[a-z0-9]+")
+
+
+class StubConfig:
+    def __init__(self, args):
+        self.dim = args.dim
+        self.embed_latency = args.embed_latency_ms / 1000.0
+        self.chat_latency = args.chat_latency_ms / 1000.0
+        self.jitter = args.jitter_ms / 1000.0
+        self.error_rate = args.error_rate
+        self.error_status = args.error_status
+        self.stream_chunks = args.stream_chunks
+        self.rng = random.Random(args.seed)
+        self.lock = threading.Lock()
+        self.requests = 0
+
+    def draw(self):
+        """(jitter factor in [-1, 1], whether to inject an error) for one request."""
+        with self.lock:
+            self.requests += 1
+            return self.rng.uniform(-1.0, 1.0), self.rng.random() < self.error_rate
+
+
+CONFIG = None
+
+
+@lru_cache(maxsize=65536)
+def word_vector(word, dim):
+    # expand a SHA-256 of the word into dim values in [-1, 1)
+    out = []
+    counter = 0
+    while len(out) < dim:
+        digest = hashlib.sha256(f"{word}:{counter}".encode()).digest()
+        out.extend(v / 2147483648.0 for v in struct.unpack("<8i", digest))
+        counter += 1
+    return out[:dim]
+
+
+def embed_text(text, dim):
+    words = WORD_RE.findall(text.lower()) or [""]
+    acc = [0.0] * dim
+    for w in words:
+        for i, v in enumerate(word_vector(w, dim)):
+            acc[i] += v
+    norm = math.sqrt(sum(v * v for v in acc)) or 1.0
+    return [v / norm for v in acc]
+
+
+def count_tokens(text):
+    return max(1, len(text) // 4)
+
+
+def canned_answer(messages):
+    question = messages[-1].get("content", "") if messages else ""
+    digest = hashlib.sha256(question.encode()).hexdigest()[:8]
+    return f"Stub answer {digest}: this is a canned completion for a {len(question)}-character prompt."
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, fmt, *args):  # keep benchmark output clean
+        pass
+
+    def send_json(self, status, payload):
+        body = json.dumps(payload).encode()
+        self.send_response(status)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_POST(self):
+        length = int(self.headers.get("Content-Length", 0))
+        try:
+            req = json.loads(self.rfile.read(length) or b"{}")
+        except json.JSONDecodeError:
+            self.send_json(400, {"error": {"message": "invalid JSON", "type": "invalid_request_error"}})
+            return
+
+        path = self.path.split("?", 1)[0]
+        if path.startswith("/v1/"):
+            path = path[3:]
+
+        if path == "/embeddings":
+            base = CONFIG.embed_latency
+        elif path == "/chat/completions":
+            base = CONFIG.chat_latency
+        else:
+            self.send_json(404, {"error": {"message": f"unknown path {self.path}"}})
+            return
+
+        jitter, fail = CONFIG.draw()
+        time.sleep(max(0.0, base + jitter * CONFIG.jitter))
+        if fail:
+            self.send_json(CONFIG.error_status,
+                           {"error": {"message": "injected failure", "type": "server_error"}})
+            return
+
+        if path == "/embeddings":
+            self.handle_embeddings(req)
+        else:
+            self.handle_chat(req)
+
+    def handle_embeddings(self, req):
+        inputs = req.get("input", "")
+        if isinstance(inputs, str):
+            inputs = [inputs]
+        data = [{"object": "embedding", "index": i, "embedding": embed_text(t, CONFIG.dim)}
+                for i, t in enumerate(inputs)]
+        tokens = sum(count_tokens(t) for t in inputs)
+        self.send_json(200, {
+            "object": "list",
+            "data": data,
+            "model": req.get("model", "stub-embedding"),
+            "usage": {"prompt_tokens": tokens, "total_tokens": tokens},
+        })
+
+    def handle_chat(self, req):
+        messages = req.get("messages", [])
+        model = req.get("model", "stub-chat")
+        answer = canned_answer(messages)
+        prompt_tokens = sum(count_tokens(m.get("content", "")) for m in messages)
+        completion_tokens = count_tokens(answer)
+        usage = {
+            "prompt_tokens": prompt_tokens,
+            "completion_tokens": completion_tokens,
+            "total_tokens": prompt_tokens + completion_tokens,
+        }
+        created = int(time.time())
+
+        if not req.get("stream"):
+            self.send_json(200, {
+                "id": "chatcmpl-stub",
+                "object": "chat.completion",
+                "created": created,
+                "model": model,
+                "choices": [{"index": 0, "finish_reason": "stop",
+                             "message": {"role": "assistant", "content": answer}}],
+                "usage": usage,
+            })
+            return
+
+        # server-sent events: role, content pieces, finish, then [DONE]
+        self.send_response(200)
+        self.send_header("Content-Type", "text/event-stream")
+        self.send_header("Cache-Control", "no-cache")
+        self.send_header("Connection", "close")
+        self.end_headers()
+        self.close_connection = True
+
+        def event(delta, finish=None, with_usage=False):
+            chunk = {"id": "chatcmpl-stub", "object": "chat.completion.chunk", "created": created,
+                     "model": model, "choices": [{"index": 0, "delta": delta, "finish_reason": finish}]}
+            if with_usage:
+                chunk["usage"] = usage
+            self.wfile.write(f"data: {json.dumps(chunk)}\n\n".encode())
+            self.wfile.flush()
+
+        event({"role": "assistant"})
+        step = max(1, math.ceil(len(answer) / CONFIG.stream_chunks))
+        for i in range(0, len(answer), step):
+            event({"content": answer[i:i + step]})
+        include_usage = (req.get("stream_options") or {}).get("include_usage", False)
+        event({}, finish="stop", with_usage=include_usage)
+        self.wfile.write(b"data: [DONE]\n\n")
+        self.wfile.flush()
+
+
+def main():
+    global CONFIG
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8089)
+    parser.add_argument("--dim", type=int, default=1536, help="embedding dimension")
+    parser.add_argument("--embed-latency-ms", type=float, default=0.0)
+    parser.add_argument("--chat-latency-ms", type=float, default=0.0)
+    parser.add_argument("--jitter-ms", type=float, default=0.0,
+                        help="uniform +/- jitter added to each latency")
+    parser.add_argument("--error-rate", type=float, default=0.0,
+                        help="fraction of requests answered with --error-status")
+    parser.add_argument("--error-status", type=int, default=500)
+    parser.add_argument("--stream-chunks", type=int, default=8,
+                        help="content pieces per streamed completion")
+    parser.add_argument("--seed", type=int, default=0, help="seed for jitter and error injection")
+    args = parser.parse_args()
+    CONFIG = StubConfig(args)
+
+    server = ThreadingHTTPServer((args.host, args.port), Handler)
+    server.daemon_threads = True
+    print(f"Stub LLM server on http://{server.server_address[0]}:{server.server_address[1]}/v1",
+          flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -69,6 +69,8 @@ app.add_middleware(
 
 class QueryRequest(BaseModel):
     question: str
+    # only answer from documents under these folders of data/
+    source_prefixes: Optional[List[str]] = None
 
 
 class QueryResponse(BaseModel):
@@ -85,11 +87,14 @@ class DocumentInfo(BaseModel):
 # --- Helper Functions ---
 
 
-def query_sentra(question: str) -> str:
+def query_sentra(question: str, source_prefixes: Optional[List[str]] = None) -> str:
     """Call the C++ binary and get response"""
+    args = [str(SENTRA_BIN)]
+    for prefix in source_prefixes or []:
+        args += ["--filter", prefix]
     try:
         result = subprocess.run(
-            [str(SENTRA_BIN)],
+            args,
             input=f"{question}\nexit\n",
             capture_output=True,
             text=True,
@@ -135,7 +140,7 @@ async def query(req: QueryRequest):
         if not req.question.strip():
             raise HTTPException(status_code=400, detail="Question cannot be empty")
 
-        answer = query_sentra(req.question)
+        answer = query_sentra(req.question, req.source_prefixes)
         status_label = "success"
         return QueryResponse(answer=answer)
 
@@ -205,15 +210,22 @@ async def trigger_ingest():
             check=True,
         )
 
-        # Delete old index to force rebuild
-        (ARTIFACTS_DIR / "index.bin").unlink(missing_ok=True)
-        (ARTIFACTS_DIR / "metadata.json").unlink(missing_ok=True)
+        # Sync the index in place: only changed files are re-embedded and the
+        # new checkpoint is published atomically, so queries keep being served
+        # from the previous index until it is ready.
+        sync = subprocess.run(
+            [str(SENTRA_BIN), "--sync"],
+            cwd=str(BACKEND_DIR),
+            capture_output=True,
+            text=True,
+            check=True,
+        )
 
         status_label = "success"
         return {
             "status": "success",
-            "message": "Ingestion complete. Index will rebuild on next query.",
-            "output": result.stdout,
+            "message": "Ingestion complete. Index is up to date.",
+            "output": result.stdout + sync.stdout,
         }
     except subprocess.CalledProcessError as e:
         raise HTTPException(status_code=500, detail=f"Ingestion failed: {e.stderr}")
@@ -278,6 +290,10 @@ async def get_stats():
 async def metrics():
     """Prometheus metrics endpoint"""
     data = generate_latest()
+    # per-stage engine histograms, accumulated by every sentra run
+    engine_metrics = ARTIFACTS_DIR / "engine_metrics.prom"
+    if engine_metrics.exists():
+        data += engine_metrics.read_bytes()
     return Response(content=data, media_type=CONTENT_TYPE_LATEST)
 
 
@@ -10,6 +10,37 @@
 #include <algorithm>
 #include <cstdio>   // popen / _popen
 #include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <unordered_map>
+#include <cctype>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <random>
+#include <limits>
+#include <thread>
+#include <future>
+#include <functional>
+#include <bitset>
+#include <sstream>
+#include <new>
+#include <memory_resource>
+#include <charconv>
+
+#ifdef _WIN32
+#include <io.h>     // _commit, _locking
+#include <malloc.h> // _aligned_malloc
+#include <fcntl.h>
+#include <sys/locking.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>    // open
+#include <unistd.h>   // fsync
+#include <sys/file.h> // flock
+#endif
 
 #include "json.hpp"  // nlohmann::json (json.hpp in the same folder)
 
@@ -28,21 +59,153 @@ struct SentraConfig {
     std::string artifactsDir = "artifacts";
     std::string indexPath    = "artifacts/index.bin";
     std::string metaPath     = "artifacts/metadata.json";
+    std::string walPath      = "artifacts/index.wal";
+    std::string lockPath     = "artifacts/index.lock";
+    std::string lexicalPath  = "artifacts/lexical.bin";
 
     int topK = 3;
+
+    // hybrid retrieval: the semantic and keyword retrievers each return
+    // fusionPoolK candidates, fused ("rrf" or "weighted") into the final topK
+    std::string fusionMode = "rrf";
+    int fusionPoolK        = 10;
+    float semanticWeight   = 1.0f;
+    float keywordWeight    = 1.0f;
+    int semanticDeadlineMs = 20000;   // includes the embeddings API call
+    int keywordDeadlineMs  = 250;
+
+    // off-topic handling: semantic hits below relevanceThreshold (cosine)
+    // are dropped, and if none is left the chat call is skipped
+    // ("refuse": reply offTopicAnswer) or sent without context
+    // ("no-context"); -1 keeps every hit
+    float relevanceThreshold   = -1.0f;
+    std::string offTopicMode   = "refuse";
+    std::string offTopicAnswer = "I couldn't find anything about that in the indexed documents.";
+
+    // diversity: the fused list is cut to mmrPoolK and then topK results are
+    // picked by maximal marginal relevance, trading relevance (mmrLambda)
+    // against similarity to results already picked; 1.0 turns it off
+    float mmrLambda = 0.5f;
+    int mmrPoolK    = 12;
+
+    // segmented index: new chunks go to a mutable segment of memtableSize
+    // entries; mergeFanIn adjacent segments smaller than smallSegmentSize are
+    // merged in the background, and a segment whose tombstoned fraction
+    // crosses compactionThreshold is rewritten without its dead entries
+    std::size_t memtableSize     = 1024;
+    std::size_t smallSegmentSize = 16384;
+    int mergeFanIn               = 4;
+    double compactionThreshold   = 0.25;
+
+    // index builds write a checkpoint once the WAL outgrows
+    // checkpointWalRatio times the last checkpoint (and at least
+    // checkpointMinWalBytes). Every chunk is already durable in the WAL, so
+    // checkpoints only bound replay time; growing them geometrically keeps
+    // the bytes a build writes linear in the index size.
+    double checkpointWalRatio          = 1.0;
+    std::size_t checkpointMinWalBytes  = std::size_t{32} << 20;
+
+    // chunks whose SimHashes differ in at most this many bits are collapsed
+    // into one entry before embedding; -1 keeps every chunk. Chunks shorter
+    // than nearDuplicateMinTokens are collapsed only when identical: a few
+    // bits there can be a part number or version that must stay searchable.
+    int nearDuplicateDistance = 3;
+    std::size_t nearDuplicateMinTokens = 32;
+
+    // HTTP cassette: "record" saves every API response to httpCassettePath,
+    // "replay" serves them from it without touching the network, waiting
+    // the recorded latency ("original") or not at all ("none")
+    std::string httpCassetteMode = "off";
+    std::string httpCassettePath;
+    std::string replayLatency    = "original";
+
+    // engine metrics (Prometheus text format) are merged into this file
+    // when the CLI exits; the frontend serves it from /metrics
+    std::string metricsPath = "artifacts/engine_metrics.prom";
+
+    // USD per 1K tokens, for cost accounting; cached prompt tokens are
+    // billed at the cached rate instead of the prompt rate
+    double embeddingCostPer1K      = 0.00002;
+    double chatPromptCostPer1K     = 0.0002;
+    double chatCachedCostPer1K     = 0.00002;
+    double chatCompletionCostPer1K = 0.0004;
+};
+
+// Token counts from the `usage` block of one API response.
+struct TokenUsage {
+    std::string model;
+    uint64_t promptTokens     = 0;
+    uint64_t completionTokens = 0;
+    uint64_t cachedTokens     = 0;   // prompt tokens served from the provider's cache
+
+    double costUsd(double promptPer1K, double cachedPer1K, double completionPer1K) const {
+        uint64_t cached = std::min(cachedTokens, promptTokens);
+        return (static_cast<double>(promptTokens - cached) * promptPer1K +
+                static_cast<double>(cached) * cachedPer1K +
+                static_cast<double>(completionTokens) * completionPer1K) / 1000.0;
+    }
 };
 
 struct Document {
     std::string id;
     std::string sourcePath;
     std::string content;
+    // other sources with a near-identical chunk that was collapsed into
+    // this one (page headers, footers, boilerplate)
+    std::vector<std::string> aliasSources;
+};
+
+// Restricts a search to chunks from the listed source files and/or from
+// sources under any of the listed path prefixes (e.g. a customer folder).
+// An empty filter matches everything.
+struct SearchFilter {
+    std::vector<std::string> sources;
+    std::vector<std::string> pathPrefixes;
+
+    bool empty() const {
+        return sources.empty() && pathPrefixes.empty();
+    }
+
+    bool matchesSource(const std::string& path) const {
+        if (empty()) return true;
+        if (std::find(sources.begin(), sources.end(), path) != sources.end()) return true;
+        for (const auto& p : pathPrefixes) {
+            if (path.compare(0, p.size(), p) == 0) return true;
+        }
+        return false;
+    }
+
+    bool matches(const Document& d) const {
+        if (matchesSource(d.sourcePath)) return true;
+        for (const auto& alias : d.aliasSources) {
+            if (matchesSource(alias)) return true;
+        }
+        return false;
+    }
 };
 
-struct IndexEntry {
-    Document doc;
-    std::vector<float> embedding;
+struct IndexSnapshot;
+
+// A retrieved chunk and the score its retriever gave it (higher is better).
+// Nothing is copied out of the index: `doc` and `embedding` point at the
+// row in its segment, and `snapshot` keeps that segment alive, so results
+// stay valid while the index is updated, merged or reloaded underneath.
+struct Candidate {
+    const Document* doc = nullptr;
+    float score = 0.0f;
+    const float* embedding = nullptr;   // the stored vector, for diversity reranking
+    std::size_t dim = 0;
+    float norm = 0.0f;
+    std::shared_ptr<const IndexSnapshot> snapshot;
+
+    std::string_view id() const { return doc->id; }
+    std::string_view sourcePath() const { return doc->sourcePath; }
+    std::string_view content() const { return doc->content; }
 };
 
+// Context entries for one prompt, usually in the query's arena.
+using ContextChunks = std::pmr::vector<std::pmr::string>;
+
 // ---------------------- Small utilities ----------------------
 
 std::string readFileToString(const std::string& path) {
@@ -55,7 +218,7 @@ std::string readFileToString(const std::string& path) {
     return data;
 }
 
-void writeStringToFile(const std::string& path, const std::string& data) {
+void writeStringToFile(const std::string& path, std::string_view data) {
     std::ofstream out(path, std::ios::binary);
     if (!out) {
         throw std::runtime_error("Failed to write file: " + path);
@@ -63,8 +226,30 @@ void writeStringToFile(const std::string& path, const std::string& data) {
     out.write(data.data(), static_cast<std::streamsize>(data.size()));
 }
 
+// Fast non-cryptographic 64-bit hash, eight bytes per step; used to find
+// byte-identical chunks.
+uint64_t hashBytes(const char* p, std::size_t n) {
+    const uint64_t m = 0x9e3779b97f4a7c15ull;
+    auto mix = [](uint64_t x) {
+        x ^= x >> 31;
+        x *= 0xbf58476d1ce4e5b9ull;
+        return x ^ (x >> 29);
+    };
+    uint64_t h = static_cast<uint64_t>(n) * m;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t k;
+        std::memcpy(&k, p, 8);
+        h = (h ^ mix(k)) * m;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, p, n);
+    h = (h ^ mix(tail)) * m;
+    return mix(h);
+}
+
 // run a shell command and capture stdout
-std::string runCommand(const std::string& cmd) {
+std::pmr::string runCommand(const std::string& cmd,
+                            std::pmr::memory_resource* mr = std::pmr::get_default_resource()) {
 #ifdef _WIN32
     FILE* pipe = _popen(cmd.c_str(), "r");
 #else
@@ -74,10 +259,12 @@ std::string runCommand(const std::string& cmd) {
         throw std::runtime_error("Failed to run command: " + cmd);
     }
 
+    // fread, not fgets: the output is kept byte for byte, NULs included
     char buffer[4096];
-    std::string result;
-    while (fgets(buffer, sizeof(buffer), pipe)) {
-        result += buffer;
+    std::pmr::string result(mr);
+    std::size_t n = 0;
+    while ((n = std::fread(buffer, 1, sizeof(buffer), pipe)) > 0) {
+        result.append(buffer, n);
     }
 
 #ifdef _WIN32
@@ -90,17 +277,685 @@ std::string runCommand(const std::string& cmd) {
     return result;
 }
 
+// ---------------------- Allocation profiling ----------------------
+
+// Heap allocations made: a count and the bytes requested.
+struct AllocCount {
+    uint64_t allocs = 0;
+    uint64_t bytes = 0;
+
+    AllocCount& operator+=(const AllocCount& o) {
+        allocs += o.allocs;
+        bytes += o.bytes;
+        return *this;
+    }
+};
+
+// Building with -DSENTRA_ALLOC_PROFILE replaces the global operator new with
+// one that counts every allocation, per thread (for per-stage attribution)
+// and per process (for benchmarks). Without it nothing is counted and every
+// AllocScope reads zero.
+#ifdef SENTRA_ALLOC_PROFILE
+constexpr bool kAllocProfiling = true;
+
+inline AllocCount& threadAllocs() {
+    thread_local AllocCount count;
+    return count;
+}
+
+inline std::atomic<uint64_t> processAllocCount[2];   // allocations, bytes
+
+inline void countAllocation(std::size_t n) {
+    AllocCount& t = threadAllocs();
+    ++t.allocs;
+    t.bytes += n;
+    processAllocCount[0].fetch_add(1, std::memory_order_relaxed);
+    processAllocCount[1].fetch_add(n, std::memory_order_relaxed);
+}
+
+void* operator new(std::size_t n) {
+    countAllocation(n);
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t n, std::align_val_t align) {
+    countAllocation(n);
+    auto a = static_cast<std::size_t>(align);
+#ifdef _WIN32
+    if (void* p = _aligned_malloc(n ? n : 1, a)) return p;
+#else
+    if (void* p = std::aligned_alloc(a, (std::max<std::size_t>(n, 1) + a - 1) / a * a)) return p;
+#endif
+    throw std::bad_alloc();
+}
+
+// kept out of line: once inlined next to a `new`, GCC flags the free()
+// as a mismatched deallocation
+#if defined(__GNUC__)
+#define SENTRA_NOINLINE __attribute__((noinline))
+#else
+#define SENTRA_NOINLINE
+#endif
+
+SENTRA_NOINLINE void operator delete(void* p) noexcept { std::free(p); }
+SENTRA_NOINLINE void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+SENTRA_NOINLINE void operator delete(void* p, std::align_val_t) noexcept {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    std::free(p);
+#endif
+}
+
+SENTRA_NOINLINE void operator delete(void* p, std::size_t, std::align_val_t align) noexcept {
+    operator delete(p, align);
+}
+#else
+constexpr bool kAllocProfiling = false;
+#endif
+
+// Allocations made by the whole process so far (zero when not profiling).
+inline AllocCount processAllocs() {
+#ifdef SENTRA_ALLOC_PROFILE
+    return {processAllocCount[0].load(std::memory_order_relaxed),
+            processAllocCount[1].load(std::memory_order_relaxed)};
+#else
+    return {};
+#endif
+}
+
+// Allocations made on this thread since the scope was opened.
+class AllocScope {
+public:
+    AllocScope() {
+#ifdef SENTRA_ALLOC_PROFILE
+        start_ = threadAllocs();
+#endif
+    }
+
+    AllocCount delta() const {
+#ifdef SENTRA_ALLOC_PROFILE
+        const AllocCount& now = threadAllocs();
+        return {now.allocs - start_.allocs, now.bytes - start_.bytes};
+#else
+        return {};
+#endif
+    }
+
+private:
+    AllocCount start_;
+};
+
+// ---------------------- Per-query arena ----------------------
+
+// Scratch memory for one query's temporaries: context entries, the prompt,
+// the chat request body and the raw response. Allocating bumps a pointer,
+// freeing is a no-op, and everything is dropped at once when the arena
+// goes out of scope at the end of the query. Each thread keeps its first
+// block for its next query, so concurrently served queries rarely reach
+// the global allocator at all; a query that outgrows the block spills
+// into upstream blocks that are freed with the arena.
+class QueryArena {
+public:
+    static constexpr std::size_t kBlockSize = 64 * 1024;
+
+    QueryArena() : block_(takeBlock()), resource_(block_.get(), kBlockSize) {}
+
+    ~QueryArena() {
+        resource_.release();
+        auto& spare = spareBlock();
+        if (!spare) spare = std::move(block_);
+    }
+
+    QueryArena(const QueryArena&) = delete;
+    QueryArena& operator=(const QueryArena&) = delete;
+
+    std::pmr::memory_resource* resource() { return &resource_; }
+
+private:
+    std::unique_ptr<char[]> block_;
+    std::pmr::monotonic_buffer_resource resource_;
+
+    static std::unique_ptr<char[]>& spareBlock() {
+        thread_local std::unique_ptr<char[]> block;
+        return block;
+    }
+
+    // the thread's spare block, or a new one if it is in use (nested arenas)
+    static std::unique_ptr<char[]> takeBlock() {
+        auto& spare = spareBlock();
+        if (spare) return std::move(spare);
+        return std::unique_ptr<char[]>(new char[kBlockSize]);
+    }
+};
+
+// ---------------------- Durable files (fsync + atomic rename) ----------------------
+
+// flush stdio buffers and force the data to stable storage
+void syncFile(FILE* f) {
+    std::fflush(f);
+#ifdef _WIN32
+    _commit(_fileno(f));
+#else
+    ::fsync(fileno(f));
+#endif
+}
+
+// make a completed rename survive a power loss (no-op on Windows)
+void syncDirectory(const fs::path& dir) {
+#ifndef _WIN32
+    int fd = ::open(dir.empty() ? "." : dir.string().c_str(), O_RDONLY);
+    if (fd >= 0) {
+        ::fsync(fd);
+        ::close(fd);
+    }
+#else
+    (void)dir;
+#endif
+}
+
+// rename `from` over `to` and persist the directory entry
+void commitFile(const std::string& from, const std::string& to) {
+    fs::rename(from, to);
+    syncDirectory(fs::path(to).parent_path());
+}
+
+void writeStringToFileDurably(const std::string& path, const std::string& data) {
+    FILE* f = std::fopen(path.c_str(), "wb");
+    if (!f) {
+        throw std::runtime_error("Failed to write file: " + path);
+    }
+    bool ok = std::fwrite(data.data(), 1, data.size(), f) == data.size();
+    syncFile(f);
+    ok = (std::fclose(f) == 0) && ok;
+    if (!ok) {
+        throw std::runtime_error("Failed to write file: " + path);
+    }
+}
+
+// Advisory inter-process lock held by the one process allowed to mutate the
+// on-disk index (sync, WAL appends, checkpoints). The OS drops it when the
+// process exits, so a crash never leaves a stale lock behind.
+class IndexWriterLock {
+public:
+    explicit IndexWriterLock(std::string path) : path_(std::move(path)) {}
+
+    IndexWriterLock(const IndexWriterLock&) = delete;
+    IndexWriterLock& operator=(const IndexWriterLock&) = delete;
+
+    ~IndexWriterLock() {
+        unlock();
+    }
+
+    // closing the descriptor releases the lock
+    void unlock() {
+        if (fd_ < 0) return;
+#ifdef _WIN32
+        _close(fd_);
+#else
+        ::close(fd_);
+#endif
+        fd_ = -1;
+    }
+
+    // Returns false if another process holds the lock (or, with wait,
+    // if it could not be acquired at all).
+    bool tryLock(bool wait = false) {
+        if (fd_ >= 0) return true;
+#ifdef _WIN32
+        int fd = _open(path_.c_str(), _O_RDWR | _O_CREAT, _S_IREAD | _S_IWRITE);
+        if (fd < 0) return false;
+        while (_locking(fd, _LK_NBLCK, 1) != 0) {
+            if (!wait) {
+                _close(fd);
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        }
+#else
+        int fd = ::open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return false;
+        if (::flock(fd, wait ? LOCK_EX : (LOCK_EX | LOCK_NB)) != 0) {
+            ::close(fd);
+            return false;
+        }
+#endif
+        fd_ = fd;
+        return true;
+    }
+
+    bool held() const { return fd_ >= 0; }
+
+private:
+    std::string path_;
+    int fd_ = -1;
+};
+
+uint32_t crc32(const char* data, std::size_t len) {
+    static const auto table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (std::size_t i = 0; i < len; ++i) {
+        crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// ---------------------- Tracing (Chrome trace-event spans) ----------------------
+
+// One completed span. Names and categories are string literals; the detail
+// is copied (truncated) so producers never allocate.
+struct TraceEvent {
+    const char* name = "";
+    const char* cat = "";
+    int64_t startNs = 0;   // since the tracer started
+    int64_t durNs = 0;
+    uint32_t tid = 0;
+    uint64_t query = 0;    // 0: not part of a query
+    AllocCount allocs;     // on this thread, with -DSENTRA_ALLOC_PROFILE
+    char detail[64] = {};
+};
+
+// Bounded multi-producer / single-consumer ring (Vyukov). Each slot's
+// sequence number says whether it is free for position p (seq == p) or
+// holds the event written at p (seq == p + 1). Producers never block or
+// lock: when the ring is full the event is dropped and counted.
+class TraceRing {
+public:
+    explicit TraceRing(std::size_t capacityPow2)
+        : mask_(capacityPow2 - 1), slots_(new Slot[capacityPow2]) {
+        for (std::size_t i = 0; i < capacityPow2; ++i) {
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool push(const TraceEvent& ev) {
+        uint64_t pos = head_.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots_[pos & mask_];
+            uint64_t seq = slot.seq.load(std::memory_order_acquire);
+            auto diff = static_cast<int64_t>(seq - pos);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.ev = ev;
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer only.
+    bool pop(TraceEvent& ev) {
+        Slot& slot = slots_[tail_ & mask_];
+        if (slot.seq.load(std::memory_order_acquire) != tail_ + 1) return false;
+        ev = slot.ev;
+        slot.seq.store(tail_ + mask_ + 1, std::memory_order_release);
+        ++tail_;
+        return true;
+    }
+
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> seq{0};
+        TraceEvent ev;
+    };
+
+    const uint64_t mask_;
+    std::unique_ptr<Slot[]> slots_;
+    alignas(64) std::atomic<uint64_t> head_{0};
+    alignas(64) uint64_t tail_ = 0;
+    std::atomic<uint64_t> dropped_{0};
+};
+
+// Writes spans to a file in the Chrome trace-event JSON array format, which
+// chrome://tracing and Perfetto open directly; the closing bracket is
+// optional there, so a trace cut short by a crash still loads. A background
+// thread drains the ring every 50 ms. At most one tracer is active.
+class Tracer {
+public:
+    explicit Tracer(const std::string& path)
+        : ring_(1 << 14), out_(path, std::ios::binary | std::ios::trunc),
+          epoch_(std::chrono::steady_clock::now()) {
+        if (!out_) {
+            throw std::runtime_error("Failed to open trace file: " + path);
+        }
+        out_ << "[\n";
+        writer_ = std::thread([this]() {
+            while (!stop_.load(std::memory_order_acquire)) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                drain();
+            }
+            drain();
+        });
+        active_.store(this, std::memory_order_release);
+    }
+
+    ~Tracer() {
+        // a span that loaded active_ just before it was cleared may still
+        // be reading the clock or recording; wait it out so nothing
+        // touches the ring after the final drain
+        active_.store(nullptr);
+        while (pins_.load() > 0) std::this_thread::yield();
+        stop_.store(true, std::memory_order_release);
+        writer_.join();
+        out_ << "\n]\n";
+        if (ring_.dropped() > 0) {
+            std::cerr << "[WARN] Trace ring was full; dropped " << ring_.dropped() << " spans\n";
+        }
+    }
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    static Tracer* active() { return active_.load(std::memory_order_acquire); }
+
+    // Keeps the active tracer alive while held: ~Tracer clears active_ and
+    // then waits for every pin to be released. get() is null once tracing
+    // is off. Pins are held only around a clock read or a record, so
+    // shutdown never waits on a long span.
+    class Pin {
+    public:
+        Pin() {
+            pins_.fetch_add(1);   // seq_cst, pairs with ~Tracer
+            tracer_ = active_.load();
+        }
+        ~Pin() { pins_.fetch_sub(1, std::memory_order_release); }
+
+        Pin(const Pin&) = delete;
+        Pin& operator=(const Pin&) = delete;
+
+        Tracer* get() const { return tracer_; }
+
+    private:
+        Tracer* tracer_;
+    };
+
+    int64_t nowNs() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - epoch_).count();
+    }
+
+    void record(const TraceEvent& ev) { ring_.push(ev); }
+
+    // Small per-thread number for the trace's tid field.
+    static uint32_t threadId() {
+        static std::atomic<uint32_t> next{0};
+        thread_local uint32_t id = ++next;
+        return id;
+    }
+
+    // The query spans on this thread belong to (see TraceQueryScope).
+    static uint64_t& currentQuery() {
+        thread_local uint64_t query = 0;
+        return query;
+    }
+
+private:
+    static inline std::atomic<Tracer*> active_{nullptr};
+    static inline std::atomic<int> pins_{0};
+
+    TraceRing ring_;
+    std::ofstream out_;
+    std::chrono::steady_clock::time_point epoch_;
+    std::atomic<bool> stop_{false};
+    std::thread writer_;
+    bool first_ = true;
+
+    void drain() {
+        TraceEvent ev;
+        bool any = false;
+        while (ring_.pop(ev)) {
+            json e = {{"name", ev.name}, {"cat", ev.cat}, {"ph", "X"},
+                      {"ts", static_cast<double>(ev.startNs) / 1000.0},
+                      {"dur", static_cast<double>(ev.durNs) / 1000.0},
+                      {"pid", 1}, {"tid", ev.tid}};
+            if (ev.query) e["args"]["query"] = ev.query;
+            if (ev.detail[0]) e["args"]["detail"] = std::string(ev.detail);
+            if (kAllocProfiling) {
+                e["args"]["allocs"] = ev.allocs.allocs;
+                e["args"]["alloc_bytes"] = ev.allocs.bytes;
+            }
+            out_ << (first_ ? "" : ",\n") << e.dump();
+            first_ = false;
+            any = true;
+        }
+        if (any) out_.flush();
+    }
+};
+
+// Spans on this thread belong to `query` until the scope ends. Work handed
+// to another thread takes Tracer::currentQuery() along and opens its own.
+class TraceQueryScope {
+public:
+    explicit TraceQueryScope(uint64_t query) : prev_(Tracer::currentQuery()) {
+        Tracer::currentQuery() = query;
+    }
+    ~TraceQueryScope() { Tracer::currentQuery() = prev_; }
+
+private:
+    uint64_t prev_;
+};
+
+// RAII span; costs one atomic load when tracing is off. The tracer is
+// pinned only while the span reads its clock or records, and a span whose
+// tracer stopped in the meantime is dropped.
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name, const char* cat = "engine", const std::string& detail = {}) {
+        if (!Tracer::active()) return;
+        Tracer::Pin pin;
+        tracer_ = pin.get();
+        if (!tracer_) return;
+        ev_.name = name;
+        ev_.cat = cat;
+        ev_.startNs = tracer_->nowNs();
+        setDetail(detail);
+    }
+
+    ~TraceSpan() {
+        if (!tracer_) return;
+        Tracer::Pin pin;
+        if (pin.get() != tracer_) return;
+        ev_.durNs = tracer_->nowNs() - ev_.startNs;
+        ev_.tid = Tracer::threadId();
+        ev_.query = Tracer::currentQuery();
+        ev_.allocs = allocs_.delta();
+        tracer_->record(ev_);
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    void setDetail(const std::string& detail) {
+        if (!tracer_) return;
+        std::size_t n = std::min(detail.size(), sizeof(ev_.detail) - 1);
+        std::memcpy(ev_.detail, detail.data(), n);
+        ev_.detail[n] = '\0';
+    }
+
+    // A span measured elsewhere (e.g. curl's own timings), in tracer time.
+    static void emit(const char* name, const char* cat, int64_t startNs, int64_t durNs) {
+        if (durNs < 0 || !Tracer::active()) return;
+        Tracer::Pin pin;
+        Tracer* tracer = pin.get();
+        if (!tracer) return;
+        TraceEvent ev;
+        ev.name = name;
+        ev.cat = cat;
+        ev.startNs = startNs;
+        ev.durNs = durNs;
+        ev.tid = Tracer::threadId();
+        ev.query = Tracer::currentQuery();
+        tracer->record(ev);
+    }
+
+private:
+    Tracer* tracer_ = nullptr;
+    TraceEvent ev_;
+    AllocScope allocs_;
+};
+
 // ---------------------- "HTTP client" using system curl ----------------------
 
+// Recorded API exchanges, so a real query trace can be replayed through the
+// engine offline. The file is "SNTRCAS1" followed by records of
+//   [u64 fingerprint][u32 latency us][u32 response length][response]
+// where the fingerprint hashes the request path and body (not the API key).
+// Replay serves the responses recorded for a fingerprint in order and keeps
+// repeating the last one, so a trace can be replayed any number of times.
+class HttpCassette {
+public:
+    HttpCassette(std::string path, bool replay) : path_(std::move(path)), replay_(replay) {
+        if (replay_) {
+            load();
+            return;
+        }
+        bool fresh = !fs::exists(path_) || fs::file_size(path_) == 0;
+        out_.open(path_, std::ios::binary | std::ios::app);
+        if (!out_) {
+            throw std::runtime_error("Failed to open cassette: " + path_);
+        }
+        if (fresh) {
+            out_.write(kMagic, sizeof(kMagic));
+        } else if (readMagic() != std::string(kMagic, sizeof(kMagic))) {
+            throw std::runtime_error("Not a cassette file: " + path_);
+        }
+    }
+
+    bool replaying() const { return replay_; }
+
+    static uint64_t fingerprint(std::string_view path, std::string_view body) {
+        std::string key(path);
+        key += '\n';
+        key += body;
+        return hashBytes(key.data(), key.size());
+    }
+
+    void record(uint64_t fp, uint32_t latencyUs, std::string_view response) {
+        std::string rec(16, '\0');
+        uint32_t len = static_cast<uint32_t>(response.size());
+        std::memcpy(&rec[0], &fp, 8);
+        std::memcpy(&rec[8], &latencyUs, 4);
+        std::memcpy(&rec[12], &len, 4);
+        rec += response;
+        std::lock_guard<std::mutex> lock(mu_);
+        out_.write(rec.data(), static_cast<std::streamsize>(rec.size()));
+        out_.flush();
+    }
+
+    // False if nothing was recorded for fp.
+    bool lookup(uint64_t fp, std::pmr::string& response, uint32_t& latencyUs) {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto it = tapes_.find(fp);
+        if (it == tapes_.end()) return false;
+        Tape& tape = it->second;
+        const Entry& e = tape.entries[std::min(tape.next, tape.entries.size() - 1)];
+        if (tape.next < tape.entries.size()) ++tape.next;
+        response.assign(e.response.data(), e.response.size());
+        latencyUs = e.latencyUs;
+        return true;
+    }
+
+private:
+    static constexpr char kMagic[8] = {'S', 'N', 'T', 'R', 'C', 'A', 'S', '1'};
+
+    struct Entry {
+        uint32_t latencyUs;
+        std::string response;
+    };
+    struct Tape {
+        std::vector<Entry> entries;
+        std::size_t next = 0;
+    };
+
+    std::string path_;
+    bool replay_;
+    std::ofstream out_;
+    std::unordered_map<uint64_t, Tape> tapes_;
+    std::mutex mu_;
+
+    std::string readMagic() const {
+        std::ifstream in(path_, std::ios::binary);
+        std::string magic(sizeof(kMagic), '\0');
+        in.read(&magic[0], static_cast<std::streamsize>(magic.size()));
+        return magic;
+    }
+
+    void load() {
+        std::string data = readFileToString(path_);
+        if (data.compare(0, sizeof(kMagic), kMagic, sizeof(kMagic)) != 0) {
+            throw std::runtime_error("Not a cassette file: " + path_);
+        }
+        std::size_t pos = sizeof(kMagic);
+        while (data.size() - pos >= 16) {
+            uint64_t fp = 0;
+            uint32_t latencyUs = 0, len = 0;
+            std::memcpy(&fp, data.data() + pos, 8);
+            std::memcpy(&latencyUs, data.data() + pos + 8, 4);
+            std::memcpy(&len, data.data() + pos + 12, 4);
+            if (data.size() - pos - 16 < len) break;
+            tapes_[fp].entries.push_back({latencyUs, data.substr(pos + 16, len)});
+            pos += 16 + len;
+        }
+        if (pos != data.size()) {
+            std::cerr << "[WARN] Ignoring " << (data.size() - pos)
+                      << " bytes of truncated cassette tail\n";
+        }
+    }
+};
+
 class HttpClient {
 public:
     explicit HttpClient(const SentraConfig& cfg) : cfg_(cfg) {
         fs::create_directories(cfg_.artifactsDir);
+        if (cfg_.httpCassetteMode == "record" || cfg_.httpCassetteMode == "replay") {
+            if (cfg_.httpCassettePath.empty()) {
+                throw std::runtime_error("HTTP cassette mode needs a cassette path");
+            }
+            cassette_ = std::make_unique<HttpCassette>(cfg_.httpCassettePath,
+                                                       cfg_.httpCassetteMode == "replay");
+        } else if (cfg_.httpCassetteMode != "off") {
+            throw std::runtime_error("Unknown HTTP cassette mode: " + cfg_.httpCassetteMode);
+        }
+        if (cfg_.replayLatency != "original" && cfg_.replayLatency != "none") {
+            throw std::runtime_error("Unknown replay latency: " + cfg_.replayLatency);
+        }
     }
 
-    std::string postJson(const std::string& path, const std::string& bodyJson) {
-        // write bodyJson to a temp file
-        std::string tmpPath = cfg_.artifactsDir + "/curl_body.json";
+    // The response is allocated from `mr`.
+    std::pmr::string postJson(const std::string& path, std::string_view bodyJson,
+                              std::pmr::memory_resource* mr = std::pmr::get_default_resource()) {
+        TraceSpan span("http", "http", path);
+        if (cassette_ && cassette_->replaying()) {
+            return replay(path, bodyJson, mr);
+        }
+        auto start = std::chrono::steady_clock::now();
+
+        // write bodyJson to a temp file (one per request, so concurrent
+        // callers such as background ingest don't clobber each other)
+        static const unsigned processTag = std::random_device{}();
+        static std::atomic<unsigned> requestCounter{0};
+        std::string tmpPath = cfg_.artifactsDir + "/curl_body_" + std::to_string(processTag) +
+                              "_" + std::to_string(requestCounter.fetch_add(1)) + ".json";
         writeStringToFile(tmpPath, bodyJson);
 
         std::string url = cfg_.baseUrl + path;
@@ -112,273 +967,2939 @@ public:
                           "-H \"Authorization: Bearer " + cfg_.apiKey + "\" "
                           "-H \"Content-Type: application/json\" "
                           "--data-binary @" + tmpPath;
+        // when tracing, curl appends its phase timings after the body
+        bool timed = Tracer::active() != nullptr;
+        if (timed) {
+            cmd += std::string(" -w \"\\n") + kTimingMarker +
+                   "%{time_connect} %{time_appconnect} %{time_pretransfer} "
+                   "%{time_starttransfer} %{time_total}\"";
+        }
 
-        std::string response = runCommand(cmd);
+        std::pmr::string response = runCommand(cmd, mr);
+        if (timed) traceCurlPhases(response);
+        std::error_code ec;
+        fs::remove(tmpPath, ec);
         if (response.empty()) {
             throw std::runtime_error("Empty response from curl (or curl failed). Command: " + cmd);
         }
+        if (cassette_) {
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            cassette_->record(HttpCassette::fingerprint(path, bodyJson),
+                              static_cast<uint32_t>(std::min<long long>(us, UINT32_MAX)), response);
+        }
         return response;
     }
 
 private:
+    static constexpr const char* kTimingMarker = "__sentra_curl_timing__ ";
+
     SentraConfig cfg_;
+    std::unique_ptr<HttpCassette> cassette_;
+
+    // Strip curl's -w line from the response and emit its phases as spans,
+    // placed so the transfer ends now. curl does not time the upload
+    // separately, so sending the body is part of the wait for the first byte.
+    // The line is stripped even if the tracer stopped during the request.
+    static void traceCurlPhases(std::pmr::string& response) {
+        Tracer::Pin pin;
+        int64_t endNs = pin.get() ? pin.get()->nowNs() : 0;
+        auto pos = response.rfind(kTimingMarker);
+        if (pos == std::string::npos) return;
+        std::istringstream in(std::string(std::string_view(response).substr(pos + std::strlen(kTimingMarker))));
+        double connect = 0, tls = 0, pretransfer = 0, firstByte = 0, total = 0;
+        bool ok = static_cast<bool>(in >> connect >> tls >> pretransfer >> firstByte >> total);
+        response.erase(pos > 0 && response[pos - 1] == '\n' ? pos - 1 : pos);
+        if (!ok || !pin.get()) return;
+
+        int64_t origin = endNs - static_cast<int64_t>(total * 1e9);
+        auto emit = [&](const char* name, double from, double to) {
+            if (to > from) {
+                TraceSpan::emit(name, "http", origin + static_cast<int64_t>(from * 1e9),
+                                static_cast<int64_t>((to - from) * 1e9));
+            }
+        };
+        emit("http.connect", 0.0, connect);
+        emit("http.tls", connect, tls);
+        emit("http.wait_first_byte", pretransfer, firstByte);
+        emit("http.receive", firstByte, total);
+    }
+
+    std::pmr::string replay(const std::string& path, std::string_view bodyJson,
+                            std::pmr::memory_resource* mr) {
+        std::pmr::string response(mr);
+        uint32_t latencyUs = 0;
+        if (!cassette_->lookup(HttpCassette::fingerprint(path, bodyJson), response, latencyUs)) {
+            throw std::runtime_error("No recorded response for " + path + " request in " +
+                                     cfg_.httpCassettePath);
+        }
+        if (cfg_.replayLatency == "original") {
+            std::this_thread::sleep_for(std::chrono::microseconds(latencyUs));
+        }
+        return response;
+    }
 };
 
 // ---------------------- LLM Client (embeddings + chat completions) ----------------------
 
-class LlmClient {
-public:
-    LlmClient(const SentraConfig& cfg, HttpClient& http)
+// Length of the well-formed UTF-8 sequence starting at text[i], or 0:
+// no overlong forms, surrogates or code points past U+10FFFF.
+std::size_t utf8SequenceLength(std::string_view text, std::size_t i) {
+    auto at = [&](std::size_t k) { return static_cast<unsigned char>(text[k]); };
+    unsigned char b = at(i);
+    std::size_t n = b >= 0xC2 && b <= 0xDF ? 2 : b >= 0xE0 && b <= 0xEF ? 3 : b >= 0xF0 && b <= 0xF4 ? 4 : 0;
+    if (n == 0 || text.size() - i < n) return 0;
+    unsigned char lo = 0x80, hi = 0xBF;   // range of the second byte
+    if (b == 0xE0) lo = 0xA0;
+    if (b == 0xED) hi = 0x9F;
+    if (b == 0xF0) lo = 0x90;
+    if (b == 0xF4) hi = 0x8F;
+    if (at(i + 1) < lo || at(i + 1) > hi) return 0;
+    for (std::size_t k = 2; k < n; ++k) {
+        if (at(i + k) < 0x80 || at(i + k) > 0xBF) return 0;
+    }
+    return n;
+}
+
+// Cursor over a JSON text for responses that are read field by field
+// instead of through a DOM. Values that are skipped are scanned in place,
+// never copied.
+struct JsonCursor {
+    const char* p;
+    const char* end;
+
+    [[noreturn]] void fail() const {
+        throw std::runtime_error("Malformed JSON response");
+    }
+
+    void ws() {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) ++p;
+    }
+    bool consume(char c) {
+        ws();
+        if (p == end || *p != c) return false;
+        ++p;
+        return true;
+    }
+    void expect(char c) {
+        if (!consume(c)) fail();
+    }
+    bool atNull() {
+        ws();
+        if (end - p < 4 || std::memcmp(p, "null", 4) != 0) return false;
+        p += 4;
+        return true;
+    }
+
+    // member(key) is called at each value and must consume it
+    template <typename Fn>
+    void object(Fn&& member) {
+        expect('{');
+        if (consume('}')) return;
+        do {
+            std::string_view key = rawString();
+            expect(':');
+            member(key);
+        } while (consume(','));
+        expect('}');
+    }
+
+    template <typename Fn>
+    void array(Fn&& element) {
+        expect('[');
+        if (consume(']')) return;
+        std::size_t i = 0;
+        do {
+            element(i++);
+        } while (consume(','));
+        expect(']');
+    }
+
+    // the text between the quotes, escapes checked but left undecoded
+    std::string_view rawString() {
+        expect('"');
+        const char* start = p;
+        while (p < end && *p != '"') {
+            auto c = static_cast<unsigned char>(*p);
+            if (c < 0x20) fail();
+            if (c >= 0x80) {
+                std::size_t n = utf8SequenceLength({p, static_cast<std::size_t>(end - p)}, 0);
+                if (n == 0) fail();
+                p += n;
+                continue;
+            }
+            if (c == '\\') {
+                if (++p == end) fail();
+                if (*p == 'u') {
+                    uint32_t cp = hex4(p + 1);
+                    p += 4;
+                    if (cp >= 0xDC00 && cp < 0xE000) fail();   // low surrogate on its own
+                    if (cp >= 0xD800 && cp < 0xDC00) {
+                        if (end - p < 7 || p[1] != '\\' || p[2] != 'u') fail();
+                        uint32_t lo = hex4(p + 3);
+                        if (lo < 0xDC00 || lo >= 0xE000) fail();
+                        p += 6;
+                    }
+                } else if (std::strchr("\"\\/bfnrt", *p) == nullptr || *p == '\0') {
+                    fail();
+                }
+            }
+            ++p;
+        }
+        if (p == end) fail();
+        return {start, static_cast<std::size_t>(p++ - start)};
+    }
+
+    std::string string() {
+        std::string_view raw = rawString();
+        std::string out;
+        out.reserve(raw.size());
+        for (std::size_t i = 0; i < raw.size(); ++i) {
+            if (raw[i] != '\\') {
+                out += raw[i];
+                continue;
+            }
+            char e = raw[++i];
+            switch (e) {
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': {   // rawString() checked the digits and surrogate pairs
+                    uint32_t cp = hex4(raw.data() + i + 1);
+                    i += 4;
+                    if (cp >= 0xD800 && cp < 0xDC00) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (hex4(raw.data() + i + 3) - 0xDC00);
+                        i += 6;
+                    }
+                    appendUtf8(out, cp);
+                    break;
+                }
+                default: out += e;   // '"', '\\', '/'
+            }
+        }
+        return out;
+    }
+
+    // a number, or 0 for null. A float too large or too small for T
+    // becomes +-inf or 0, as the DOM's strtod and cast made it; one past
+    // the range of a double is rejected, as the DOM rejected it.
+    template <typename T>
+    T number() {
+        if (atNull()) return T{};
+        T v{};
+        auto [next, ec] = std::from_chars(p, end, v);
+        if constexpr (std::is_floating_point_v<T>) {
+            if (ec == std::errc::result_out_of_range) {
+                double d = outOfRange(next);
+                constexpr double max = std::numeric_limits<T>::max();
+                v = d > max ? std::numeric_limits<T>::infinity()
+                  : d < -max ? -std::numeric_limits<T>::infinity()
+                  : static_cast<T>(d);
+                ec = std::errc();
+            }
+        }
+        if (ec != std::errc()) fail();
+        checkNumber(next);
+        p = next;
+        return v;
+    }
+
+    void skip() {
+        ws();
+        if (p == end) fail();
+        switch (*p) {
+            case '"': rawString(); return;
+            case '{': object([this](std::string_view) { skip(); }); return;
+            case '[': array([this](std::size_t) { skip(); }); return;
+            case 't': literal("true"); return;
+            case 'f': literal("false"); return;
+            case 'n': literal("null"); return;
+            default: number<double>();
+        }
+    }
+
+    // only whitespace may follow the top-level value
+    void finish() {
+        ws();
+        if (p != end) fail();
+    }
+
+private:
+    void literal(std::string_view word) {
+        if (static_cast<std::size_t>(end - p) < word.size() || std::memcmp(p, word.data(), word.size()) != 0) fail();
+        p += word.size();
+    }
+
+    // the double strtod makes of the number before `last`, which must be finite
+    double outOfRange(const char* last) const {
+        double d = std::strtod(std::string(p, last).c_str(), nullptr);
+        if (!std::isfinite(d)) fail();
+        return d;
+    }
+
+    // from_chars matched [p, last); what it takes beyond JSON's grammar is
+    // inf/nan, leading zeros and a '.' with no digit on one side
+    void checkNumber(const char* last) const {
+        auto digit = [&](const char* q) { return q < last && *q >= '0' && *q <= '9'; };
+        const char* q = p + (*p == '-');
+        if (!digit(q)) fail();
+        if (*q == '0' && digit(q + 1)) fail();
+        while (digit(q)) ++q;
+        if (q < last && *q == '.' && !digit(q + 1)) fail();
+    }
+
+    uint32_t hex4(const char* at) const {
+        if (end - at < 4) fail();
+        uint32_t v = 0;
+        auto [next, ec] = std::from_chars(at, at + 4, v, 16);
+        if (ec != std::errc() || next != at + 4) fail();
+        return v;
+    }
+
+    static void appendUtf8(std::string& out, uint32_t cp) {
+        if (cp < 0x80) {
+            out += static_cast<char>(cp);
+        } else if (cp < 0x800) {
+            out += static_cast<char>(0xC0 | (cp >> 6));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            out += static_cast<char>(0xE0 | (cp >> 12));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        } else {
+            out += static_cast<char>(0xF0 | (cp >> 18));
+            out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+    }
+};
+
+// An /embeddings response, read without building a DOM. The floats of
+// data[i].embedding are parsed with std::from_chars straight into
+// vectors[i], placed by the element's "index" when it has one; besides
+// those only model, usage and error are read, and everything else is
+// skipped. Each vector is cleared but keeps its capacity, so buffers
+// reserved by the caller (or left from an earlier parse) are filled
+// without reallocating.
+struct EmbeddingResponse {
+    std::vector<std::vector<float>> vectors;
+    TokenUsage usage;      // model left as set when the response has none
+    std::string error;     // the API's error message, if it sent one
+
+    void parse(std::string_view text) {
+        JsonCursor in{text.data(), text.data() + text.size()};
+        error.clear();
+        std::size_t count = 0;
+        bool inOrder = true;
+        std::vector<std::size_t> placement;   // "index" of each element, once one is out of order
+        in.object([&](std::string_view key) {
+            if (key == "data") {
+                in.array([&](std::size_t i) {
+                    if (vectors.size() <= i) vectors.emplace_back();
+                    std::vector<float>& v = vectors[i];
+                    v.clear();
+                    std::size_t index = i;
+                    in.object([&](std::string_view field) {
+                        if (field == "embedding") {
+                            in.array([&](std::size_t) { v.push_back(in.number<float>()); });
+                        } else if (field == "index") {
+                            index = in.number<std::size_t>();
+                        } else {
+                            in.skip();
+                        }
+                    });
+                    if (index != i && inOrder) {
+                        inOrder = false;
+                        placement.resize(i);
+                        for (std::size_t k = 0; k < i; ++k) placement[k] = k;
+                    }
+                    if (!inOrder) placement.push_back(index);
+                    count = i + 1;
+                });
+            } else if (key == "model") {
+                usage.model = in.string();
+            } else if (key == "usage") {
+                if (in.atNull()) return;
+                in.object([&](std::string_view field) {
+                    if (field == "prompt_tokens") {
+                        usage.promptTokens = in.number<uint64_t>();
+                    } else if (field == "completion_tokens") {
+                        usage.completionTokens = in.number<uint64_t>();
+                    } else {
+                        in.skip();
+                    }
+                });
+            } else if (key == "error") {
+                if (in.atNull()) return;
+                in.object([&](std::string_view field) {
+                    if (field == "message") {
+                        error = in.string();
+                    } else {
+                        in.skip();
+                    }
+                });
+            } else {
+                in.skip();
+            }
+        });
+        in.finish();
+        vectors.resize(count);
+
+        if (inOrder) return;
+        std::vector<std::vector<float>> ordered(count);
+        std::vector<bool> seen(count, false);
+        for (std::size_t i = 0; i < count; ++i) {
+            std::size_t at = placement[i];
+            if (at >= count || seen[at]) in.fail();
+            seen[at] = true;
+            ordered[at] = std::move(vectors[i]);
+        }
+        vectors.swap(ordered);
+    }
+};
+
+// Appends `text` as a JSON string literal, escaped exactly as
+// json::dump() does it (UTF-8 passes through unchanged).
+// Invalid UTF-8 throws json::type_error 316, as json::dump() would.
+void appendJsonString(std::pmr::string& out, std::string_view text) {
+    static const char* hex = "0123456789abcdef";
+    out += '"';
+    for (std::size_t i = 0; i < text.size(); ++i) {
+        char ch = text[i];
+        switch (ch) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(ch) < 0x20) {
+                    out += "\\u00";
+                    out += hex[(ch >> 4) & 0xF];
+                    out += hex[ch & 0xF];
+                } else if (static_cast<unsigned char>(ch) < 0x80) {
+                    out += ch;
+                } else {
+                    std::size_t n = utf8SequenceLength(text, i);
+                    if (n == 0) {
+                        // let the DOM report it, with its exact message
+                        json(std::string(text)).dump();
+                        throw std::runtime_error("Invalid UTF-8 in request text");
+                    }
+                    out.append(text.data() + i, n);
+                    i += n - 1;
+                }
+        }
+    }
+    out += '"';
+}
+
+class LlmClient {
+public:
+    LlmClient(const SentraConfig& cfg, HttpClient& http)
         : cfg_(cfg), http_(http) {}
 
-    std::vector<float> embed(const std::string& text) {
+    // `usage`, if given, receives the token counts the API reported.
+    std::vector<float> embed(const std::string& text, TokenUsage* usage = nullptr) {
         json body;
         body["model"] = cfg_.embeddingModel;
         body["input"] = text;
 
-        std::string respStr = http_.postJson("/embeddings", body.dump());
-        json resp = json::parse(respStr);
+        std::pmr::string respStr = http_.postJson("/embeddings", body.dump());
+        TraceSpan span("json_parse", "llm", "embeddings");
+        EmbeddingResponse resp;
+        resp.usage.model = cfg_.embeddingModel;
+        resp.vectors.resize(1);
+        resp.vectors[0].reserve(lastDim_.load(std::memory_order_relaxed));
+        resp.parse(respStr);
+        if (usage) *usage = resp.usage;
+        if (!resp.error.empty()) {
+            std::cerr << "[WARN] Embedding request failed: " << resp.error << "\n";
+        }
+        if (resp.vectors.empty()) return {};
+        lastDim_.store(resp.vectors[0].size(), std::memory_order_relaxed);
+        return std::move(resp.vectors[0]);
+    }
+
+    // The prompt and request are built in the chunks' memory resource
+    // (the query's arena when called from the engine).
+    std::string chatWithContext(const std::string& question,
+                                const ContextChunks& contextChunks,
+                                TokenUsage* usage = nullptr) {
+        std::pmr::memory_resource* mr = contextChunks.get_allocator().resource();
+        const std::string_view preamble =
+            "You are SentraAI, a retrieval-augmented assistant. "
+            "Use the provided context when it is relevant to the user's question. "
+            "If the question is generic small talk (like 'hello'), you may respond normally. "
+            "If the user asks about specific facts not in the context, say you don't know.\n\n"
+            "Context:\n";
+        const std::string_view separator = "\n\n---\n\n";
+
+        std::size_t size = preamble.size() + question.size() + 32;
+        for (const auto& c : contextChunks) size += c.size() + separator.size();
+        std::pmr::string prompt(mr);
+        prompt.reserve(size);
+        prompt += preamble;
+        for (const auto& c : contextChunks) {
+            prompt += c;
+            prompt += separator;
+        }
+        prompt += "\nQuestion:\n";
+        prompt += question;
+        prompt += "\n\nAnswer:";
+        return complete(prompt, usage, mr);
+    }
+
+    // For questions nothing in the index is relevant to: a short prompt
+    // without context, so off-topic traffic costs few tokens.
+    std::string chatWithoutContext(const std::string& question, TokenUsage* usage = nullptr,
+                                   std::pmr::memory_resource* mr = std::pmr::get_default_resource()) {
+        std::pmr::string prompt(mr);
+        prompt += "You are SentraAI, a retrieval-augmented assistant. No document in the "
+                  "knowledge base matched this question. If it is small talk, reply briefly; "
+                  "otherwise say in one sentence that the documents don't cover it.\n\n"
+                  "Question:\n";
+        prompt += question;
+        prompt += "\n\nAnswer:";
+        return complete(prompt, usage, mr);
+    }
+
+private:
+    SentraConfig cfg_;
+    HttpClient& http_;
+    std::atomic<std::size_t> lastDim_{0};   // reserved up front for the next embedding
+
+    // Missing fields count as 0; the model is the one the API reports, as
+    // it may be a dated snapshot of the one requested.
+    static TokenUsage parseUsage(const json& resp, const std::string& requestedModel) {
+        TokenUsage u;
+        u.model = resp.value("model", requestedModel);
+        auto it = resp.find("usage");
+        if (it == resp.end() || !it->is_object()) return u;
+        u.promptTokens = it->value("prompt_tokens", uint64_t{0});
+        u.completionTokens = it->value("completion_tokens", uint64_t{0});
+        auto details = it->find("prompt_tokens_details");
+        if (details != it->end() && details->is_object()) {
+            u.cachedTokens = details->value("cached_tokens", uint64_t{0});
+        }
+        return u;
+    }
+
+    std::string complete(std::string_view prompt, TokenUsage* usage,
+                         std::pmr::memory_resource* mr) {
+        // serialized by hand into the arena; the bytes match json::dump()
+        // of {model, messages}, which recorded cassettes are keyed on
+        std::pmr::string body(mr);
+        body.reserve(prompt.size() + prompt.size() / 8 + 160);
+        body += "{\"messages\":[{\"content\":";
+        appendJsonString(body, "You are a helpful assistant.");
+        body += ",\"role\":\"system\"},{\"content\":";
+        appendJsonString(body, prompt);
+        body += ",\"role\":\"user\"}],\"model\":";
+        appendJsonString(body, cfg_.chatModel);
+        body += '}';
+
+        std::pmr::string respStr = http_.postJson("/chat/completions", body, mr);
+        json resp;
+        {
+            TraceSpan span("json_parse", "llm", "chat");
+            resp = json::parse(respStr);
+        }
+        if (usage) *usage = parseUsage(resp, cfg_.chatModel);
+        // DEBUG: print raw response once
+        if(DEBUG_CHAT) {
+            std::cerr << "Chat raw response:\n" << resp.dump(2) << "\n";
+        }
+
+
+        std::string answer =
+            resp["choices"][0]["message"]["content"].get<std::string>();
+        return answer;
+    }
+};
+
+// ---------------------- Write-ahead log ----------------------
+
+// Little-endian-as-host binary encoding for WAL records.
+struct ByteWriter {
+    std::string buf;
+
+    template <typename T>
+    void put(T v) {
+        buf.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+    void putString(const std::string& s) {
+        put<uint32_t>(static_cast<uint32_t>(s.size()));
+        buf += s;
+    }
+    void putFloats(const std::vector<float>& v) {
+        put<uint32_t>(static_cast<uint32_t>(v.size()));
+        buf.append(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(float));
+    }
+};
+
+struct ByteReader {
+    const char* p;
+    const char* end;
+
+    template <typename T>
+    T get() {
+        need(sizeof(T));
+        T v;
+        std::memcpy(&v, p, sizeof(T));
+        p += sizeof(T);
+        return v;
+    }
+    std::string getString() {
+        uint32_t n = get<uint32_t>();
+        need(n);
+        std::string s(p, n);
+        p += n;
+        return s;
+    }
+    std::vector<float> getFloats() {
+        uint32_t n = get<uint32_t>();
+        need(static_cast<std::size_t>(n) * sizeof(float));
+        std::vector<float> v(n);
+        std::memcpy(v.data(), p, n * sizeof(float));
+        p += n * sizeof(float);
+        return v;
+    }
+    void need(std::size_t n) const {
+        if (static_cast<std::size_t>(end - p) < n) {
+            throw std::runtime_error("Truncated WAL record");
+        }
+    }
+};
+
+// Append-only log of index mutations. Each record is
+//   [u32 payload length][u32 crc32 of payload][payload]
+// and the payload starts with its u64 LSN. Replay stops at the first torn
+// or corrupt record, which is then cut off so new records follow good ones.
+class WriteAheadLog {
+public:
+    explicit WriteAheadLog(std::string path) : path_(std::move(path)) {}
+
+    ~WriteAheadLog() {
+        close();
+    }
+
+    // Payloads with lsn > afterLsn, in log order. Only the index writer may
+    // repair a torn tail; for anyone else it may be a record being written.
+    std::vector<std::string> readFrom(uint64_t afterLsn, bool repairTail = true) {
+        std::vector<std::string> out;
+        if (!fs::exists(path_)) return out;
+
+        std::string data = readFileToString(path_);
+        std::size_t pos = 0;
+        while (data.size() - pos >= 8) {
+            uint32_t len = 0, crc = 0;
+            std::memcpy(&len, data.data() + pos, 4);
+            std::memcpy(&crc, data.data() + pos + 4, 4);
+            if (len < sizeof(uint64_t) || data.size() - pos - 8 < len) break;
+            const char* payload = data.data() + pos + 8;
+            if (crc32(payload, len) != crc) break;
+
+            uint64_t lsn = 0;
+            std::memcpy(&lsn, payload, sizeof(lsn));
+            if (lsn > afterLsn) out.emplace_back(payload, len);
+            pos += 8 + len;
+        }
+
+        if (pos != data.size() && repairTail) {
+            std::cerr << "[WARN] Discarding " << (data.size() - pos)
+                      << " bytes of torn WAL tail\n";
+            close();
+            fs::resize_file(path_, pos);
+        }
+        return out;
+    }
+
+    void append(const std::string& payload) {
+        open();
+        uint32_t len = static_cast<uint32_t>(payload.size());
+        uint32_t crc = crc32(payload.data(), payload.size());
+        std::string rec;
+        rec.reserve(8 + payload.size());
+        rec.append(reinterpret_cast<const char*>(&len), 4);
+        rec.append(reinterpret_cast<const char*>(&crc), 4);
+        rec += payload;
+        if (std::fwrite(rec.data(), 1, rec.size(), file_) != rec.size()) {
+            throw std::runtime_error("Failed to append to WAL: " + path_);
+        }
+        syncFile(file_);
+    }
+
+    // Drop every record with lsn <= upToLsn (they are in a checkpoint now).
+    // The survivors are written to a new file that replaces the log atomically.
+    void truncate(uint64_t upToLsn) {
+        std::vector<std::string> keep = readFrom(upToLsn);
+        close();
+        std::string tmp = path_ + ".tmp";
+        std::string data;
+        for (const auto& payload : keep) {
+            uint32_t len = static_cast<uint32_t>(payload.size());
+            uint32_t crc = crc32(payload.data(), payload.size());
+            data.append(reinterpret_cast<const char*>(&len), 4);
+            data.append(reinterpret_cast<const char*>(&crc), 4);
+            data += payload;
+        }
+        writeStringToFileDurably(tmp, data);
+        commitFile(tmp, path_);
+    }
+
+    void close() {
+        if (file_) {
+            std::fclose(file_);
+            file_ = nullptr;
+        }
+    }
+
+private:
+    std::string path_;
+    FILE* file_ = nullptr;
+
+    void open() {
+        if (file_) return;
+        file_ = std::fopen(path_.c_str(), "ab");
+        if (!file_) {
+            throw std::runtime_error("Failed to open WAL: " + path_);
+        }
+    }
+};
+
+// ---------------------- Lexical index (BM25) ----------------------
+
+// (term hash, term frequency) for one chunk, sorted by hash. Terms are
+// stored as 64-bit FNV-1a hashes; collisions are rare enough to ignore.
+using TermCounts = std::vector<std::pair<uint64_t, uint32_t>>;
+
+uint64_t hashTerm(const char* p, std::size_t n) {
+    uint64_t h = 1469598103934665603ull;
+    for (std::size_t i = 0; i < n; ++i) {
+        h ^= static_cast<unsigned char>(p[i]);
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Lowercased alphanumeric words. A word joined to the next by '-', '_',
+// '.' or '/' (part numbers, identifiers, paths) is also emitted as one
+// compound token, so "XK-200" matches as "xk", "200" and "xk-200".
+template <typename Fn>
+void forEachToken(const std::string& text, Fn&& emit) {
+    std::string word, compound;
+    auto isWord = [](unsigned char c) { return std::isalnum(c) != 0 || c >= 0x80; };
+    auto isJoin = [](char c) { return c == '-' || c == '_' || c == '.' || c == '/'; };
+    auto flushCompound = [&]() {
+        if (!compound.empty() && compound != word) {
+            emit(compound);
+        }
+        compound.clear();
+    };
+
+    for (std::size_t i = 0; i <= text.size(); ++i) {
+        unsigned char c = i < text.size() ? static_cast<unsigned char>(text[i]) : ' ';
+        if (isWord(c)) {
+            char lower = static_cast<char>(std::tolower(c));
+            word += lower;
+            compound += lower;
+            continue;
+        }
+        if (!word.empty()) {
+            emit(word);
+            bool joins = isJoin(static_cast<char>(c)) && i + 1 < text.size() &&
+                         isWord(static_cast<unsigned char>(text[i + 1]));
+            if (joins) {
+                compound += static_cast<char>(c);
+            } else {
+                flushCompound();
+            }
+            word.clear();
+        } else {
+            flushCompound();
+        }
+    }
+}
+
+TermCounts countTerms(const std::string& text) {
+    std::vector<uint64_t> hashes;
+    forEachToken(text, [&](const std::string& t) { hashes.push_back(hashTerm(t.data(), t.size())); });
+    std::sort(hashes.begin(), hashes.end());
+
+    TermCounts counts;
+    for (uint64_t h : hashes) {
+        if (!counts.empty() && counts.back().first == h) {
+            ++counts.back().second;
+        } else {
+            counts.emplace_back(h, 1);
+        }
+    }
+    return counts;
+}
+
+uint32_t termTotal(const TermCounts& counts) {
+    uint32_t n = 0;
+    for (const auto& tc : counts) n += tc.second;
+    return n;
+}
+
+void putVarint(std::string& out, uint32_t v) {
+    while (v >= 0x80) {
+        out += static_cast<char>((v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    out += static_cast<char>(v);
+}
+
+uint32_t getVarint(const char*& p) {
+    uint32_t v = 0;
+    int shift = 0;
+    while (true) {
+        uint8_t b = static_cast<uint8_t>(*p++);
+        v |= static_cast<uint32_t>(b & 0x7F) << shift;
+        if (!(b & 0x80)) return v;
+        shift += 7;
+    }
+}
+
+// Inverted index over the rows of one immutable segment. Each term's
+// posting list is a run of varint (row delta, tf) pairs.
+struct SegmentLexicon {
+    struct Term {
+        uint64_t hash;
+        uint32_t df;
+        uint32_t maxTf;    // with minLen, bounds the term's BM25 contribution
+        uint32_t minLen;
+        uint32_t bytes;
+        uint64_t offset;
+    };
+
+    std::vector<Term> terms;        // sorted by hash
+    std::string postings;
+    std::vector<uint32_t> docLen;   // tokens per row
+    uint64_t totalLen = 0;
+
+    const Term* find(uint64_t hash) const {
+        auto it = std::lower_bound(terms.begin(), terms.end(), hash,
+                                   [](const Term& t, uint64_t h) { return t.hash < h; });
+        return (it != terms.end() && it->hash == hash) ? &*it : nullptr;
+    }
+
+    void serialize(ByteWriter& w) const {
+        w.put<uint32_t>(static_cast<uint32_t>(docLen.size()));
+        for (uint32_t len : docLen) w.put<uint32_t>(len);
+        w.put<uint32_t>(static_cast<uint32_t>(terms.size()));
+        for (const auto& t : terms) {
+            w.put(t.hash);
+            w.put(t.df);
+            w.put(t.maxTf);
+            w.put(t.minLen);
+            w.put(t.bytes);
+            w.put(t.offset);
+        }
+        w.putString(postings);
+    }
+
+    static std::shared_ptr<SegmentLexicon> deserialize(ByteReader& r) {
+        auto lex = std::make_shared<SegmentLexicon>();
+        lex->docLen.resize(r.get<uint32_t>());
+        for (auto& len : lex->docLen) {
+            len = r.get<uint32_t>();
+            lex->totalLen += len;
+        }
+        lex->terms.resize(r.get<uint32_t>());
+        for (auto& t : lex->terms) {
+            t.hash   = r.get<uint64_t>();
+            t.df     = r.get<uint32_t>();
+            t.maxTf  = r.get<uint32_t>();
+            t.minLen = r.get<uint32_t>();
+            t.bytes  = r.get<uint32_t>();
+            t.offset = r.get<uint64_t>();
+        }
+        lex->postings = r.getString();
+        for (const auto& t : lex->terms) {
+            if (t.offset + t.bytes > lex->postings.size()) {
+                throw std::runtime_error("Corrupt lexical index");
+            }
+        }
+        return lex;
+    }
+};
+
+// Collects postings row by row (rows must be added in increasing order
+// per term) and encodes them into a SegmentLexicon.
+class LexiconBuilder {
+public:
+    explicit LexiconBuilder(std::size_t rows) : docLen_(rows, 0) {}
+
+    void addDoc(uint32_t row, const TermCounts& counts) {
+        for (const auto& [hash, tf] : counts) add(hash, row, tf);
+        docLen_[row] = termTotal(counts);
+    }
+
+    void add(uint64_t hash, uint32_t row, uint32_t tf) {
+        lists_[hash].emplace_back(row, tf);
+    }
+
+    void setDocLen(uint32_t row, uint32_t len) {
+        docLen_[row] = len;
+    }
+
+    std::shared_ptr<SegmentLexicon> finish() {
+        auto lex = std::make_shared<SegmentLexicon>();
+        lex->docLen = std::move(docLen_);
+        for (uint32_t len : lex->docLen) lex->totalLen += len;
+
+        lex->terms.reserve(lists_.size());
+        for (const auto& [hash, list] : lists_) {
+            SegmentLexicon::Term t{hash, static_cast<uint32_t>(list.size()), 0,
+                                   std::numeric_limits<uint32_t>::max(), 0,
+                                   lex->postings.size()};
+            uint32_t prev = 0;
+            for (const auto& [row, tf] : list) {
+                putVarint(lex->postings, row - prev);
+                putVarint(lex->postings, tf);
+                prev = row;
+                t.maxTf = std::max(t.maxTf, tf);
+                t.minLen = std::min(t.minLen, lex->docLen[row]);
+            }
+            t.bytes = static_cast<uint32_t>(lex->postings.size() - t.offset);
+            lex->terms.push_back(t);
+        }
+        std::sort(lex->terms.begin(), lex->terms.end(),
+                  [](const auto& a, const auto& b) { return a.hash < b.hash; });
+        lists_.clear();
+        return lex;
+    }
+
+private:
+    std::vector<uint32_t> docLen_;
+    std::unordered_map<uint64_t, std::vector<std::pair<uint32_t, uint32_t>>> lists_;
+};
+
+// Okapi BM25 with the usual parameters.
+struct Bm25 {
+    static constexpr float k1 = 1.2f;
+    static constexpr float b  = 0.75f;
+
+    float avgLen = 1.0f;
+
+    static float idf(double docs, double df) {
+        return static_cast<float>(std::log(1.0 + (docs - df + 0.5) / (df + 0.5)));
+    }
+
+    float score(float idf, uint32_t tf, uint32_t len) const {
+        float t = static_cast<float>(tf);
+        return idf * t * (k1 + 1.0f) / (t + k1 * (1.0f - b + b * static_cast<float>(len) / avgLen));
+    }
+};
+
+// ---------------------- Vector Index (storage + cosine search) ----------------------
+
+// Roaring-style set of segment rows. Rows are split into 2^16-row chunks;
+// a chunk is a sorted array of its low 16 bits while sparse and a 1024-word
+// bitset once it holds more than 4096 rows.
+class RowBitmap {
+public:
+    // rows must be added in increasing order
+    void add(uint32_t row) {
+        uint16_t key = static_cast<uint16_t>(row >> 16);
+        if (containers_.empty() || containers_.back().key != key) {
+            containers_.push_back(Container{key, {}, {}, 0});
+        }
+        containers_.back().insert(static_cast<uint16_t>(row & 0xFFFF));
+    }
+
+    void unionWith(const RowBitmap& other) {
+        std::vector<Container> out;
+        out.reserve(containers_.size() + other.containers_.size());
+        size_t i = 0, j = 0;
+        while (i < containers_.size() || j < other.containers_.size()) {
+            if (j == other.containers_.size() ||
+                (i < containers_.size() && containers_[i].key < other.containers_[j].key)) {
+                out.push_back(std::move(containers_[i++]));
+            } else if (i == containers_.size() || other.containers_[j].key < containers_[i].key) {
+                out.push_back(other.containers_[j++]);
+            } else {
+                Container c = std::move(containers_[i++]);
+                c.unionWith(other.containers_[j++]);
+                out.push_back(std::move(c));
+            }
+        }
+        containers_ = std::move(out);
+    }
+
+    void intersectWith(const RowBitmap& other) {
+        std::vector<Container> out;
+        size_t j = 0;
+        for (auto& c : containers_) {
+            while (j < other.containers_.size() && other.containers_[j].key < c.key) ++j;
+            if (j == other.containers_.size()) break;
+            if (other.containers_[j].key != c.key) continue;
+            c.intersectWith(other.containers_[j]);
+            if (c.card > 0) out.push_back(std::move(c));
+        }
+        containers_ = std::move(out);
+    }
+
+    // and-not: drop every row that is also in `other`
+    void subtract(const RowBitmap& other) {
+        std::vector<Container> out;
+        size_t j = 0;
+        for (auto& c : containers_) {
+            while (j < other.containers_.size() && other.containers_[j].key < c.key) ++j;
+            if (j < other.containers_.size() && other.containers_[j].key == c.key) {
+                c.subtract(other.containers_[j]);
+            }
+            if (c.card > 0) out.push_back(std::move(c));
+        }
+        containers_ = std::move(out);
+    }
+
+    bool contains(uint32_t row) const {
+        uint16_t key = static_cast<uint16_t>(row >> 16);
+        auto it = std::lower_bound(containers_.begin(), containers_.end(), key,
+                                   [](const Container& c, uint16_t k) { return c.key < k; });
+        return it != containers_.end() && it->key == key &&
+               it->contains(static_cast<uint16_t>(row & 0xFFFF));
+    }
 
-        const auto& embArr = resp["data"][0]["embedding"];
-        std::vector<float> embedding;
-        embedding.reserve(embArr.size());
-        for (auto& v : embArr) {
-            embedding.push_back(static_cast<float>(v.get<double>()));
+    std::size_t cardinality() const {
+        std::size_t n = 0;
+        for (const auto& c : containers_) n += c.card;
+        return n;
+    }
+
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        for (const auto& c : containers_) {
+            uint32_t high = static_cast<uint32_t>(c.key) << 16;
+            if (c.bits.empty()) {
+                for (uint16_t low : c.array) fn(high | low);
+                continue;
+            }
+            for (size_t w = 0; w < c.bits.size(); ++w) {
+                uint64_t word = c.bits[w];
+                while (word) {
+                    int bit = ctz64(word);
+                    fn(high | static_cast<uint32_t>(w * 64 + bit));
+                    word &= word - 1;
+                }
+            }
         }
-        return embedding;
     }
 
-    std::string chatWithContext(const std::string& question,
-                                const std::vector<std::string>& contextChunks) {
-        std::string contextText;
-        for (const auto& c : contextChunks) {
-            contextText += c;
-            contextText += "\n\n---\n\n";
+private:
+    static constexpr std::size_t kArrayMax = 4096;
+
+    struct Container {
+        uint16_t key;
+        std::vector<uint16_t> array;   // sorted, used while card <= kArrayMax
+        std::vector<uint64_t> bits;    // 1024 words once dense
+        uint32_t card;
+
+        void insert(uint16_t low) {
+            if (!bits.empty()) {
+                uint64_t mask = uint64_t{1} << (low & 63);
+                if (!(bits[low >> 6] & mask)) {
+                    bits[low >> 6] |= mask;
+                    ++card;
+                }
+                return;
+            }
+            if (!array.empty() && array.back() >= low) {
+                if (std::binary_search(array.begin(), array.end(), low)) return;
+                array.insert(std::lower_bound(array.begin(), array.end(), low), low);
+            } else {
+                array.push_back(low);
+            }
+            if (++card > kArrayMax) toBits();
+        }
+
+        bool contains(uint16_t low) const {
+            if (!bits.empty()) return (bits[low >> 6] >> (low & 63)) & 1u;
+            return std::binary_search(array.begin(), array.end(), low);
+        }
+
+        void toBits() {
+            bits.assign(1024, 0);
+            for (uint16_t low : array) bits[low >> 6] |= uint64_t{1} << (low & 63);
+            array.clear();
+            array.shrink_to_fit();
+        }
+
+        void unionWith(const Container& o) {
+            if (bits.empty() && o.bits.empty() && card + o.card <= kArrayMax) {
+                std::vector<uint16_t> merged;
+                merged.reserve(card + o.card);
+                std::set_union(array.begin(), array.end(), o.array.begin(), o.array.end(),
+                               std::back_inserter(merged));
+                array = std::move(merged);
+                card = static_cast<uint32_t>(array.size());
+                return;
+            }
+            if (bits.empty()) toBits();
+            if (o.bits.empty()) {
+                for (uint16_t low : o.array) bits[low >> 6] |= uint64_t{1} << (low & 63);
+            } else {
+                for (size_t w = 0; w < bits.size(); ++w) bits[w] |= o.bits[w];
+            }
+            card = 0;
+            for (uint64_t w : bits) card += static_cast<uint32_t>(popcount64(w));
+        }
+
+        void intersectWith(const Container& o) {
+            if (bits.empty()) {
+                keepIf([&](uint16_t low) { return o.contains(low); });
+            } else if (o.bits.empty()) {
+                std::vector<uint16_t> kept;
+                for (uint16_t low : o.array) {
+                    if (contains(low)) kept.push_back(low);
+                }
+                bits.clear();
+                bits.shrink_to_fit();
+                array = std::move(kept);
+                card = static_cast<uint32_t>(array.size());
+            } else {
+                for (size_t w = 0; w < bits.size(); ++w) bits[w] &= o.bits[w];
+                recount();
+            }
+        }
+
+        void subtract(const Container& o) {
+            if (bits.empty()) {
+                keepIf([&](uint16_t low) { return !o.contains(low); });
+                return;
+            }
+            if (o.bits.empty()) {
+                for (uint16_t low : o.array) bits[low >> 6] &= ~(uint64_t{1} << (low & 63));
+            } else {
+                for (size_t w = 0; w < bits.size(); ++w) bits[w] &= ~o.bits[w];
+            }
+            recount();
+        }
+
+        template <typename Pred>
+        void keepIf(Pred&& keep) {
+            array.erase(std::remove_if(array.begin(), array.end(),
+                                       [&](uint16_t low) { return !keep(low); }),
+                        array.end());
+            card = static_cast<uint32_t>(array.size());
+        }
+
+        // after clearing bits: a bitset that became sparse goes back to an array
+        void recount() {
+            card = 0;
+            for (uint64_t w : bits) card += static_cast<uint32_t>(popcount64(w));
+            if (card > kArrayMax) return;
+            array.clear();
+            array.reserve(card);
+            for (size_t w = 0; w < bits.size(); ++w) {
+                for (uint64_t word = bits[w]; word; word &= word - 1) {
+                    array.push_back(static_cast<uint16_t>(w * 64 + ctz64(word)));
+                }
+            }
+            bits.clear();
+            bits.shrink_to_fit();
+        }
+    };
+
+    std::vector<Container> containers_;   // sorted by key
+
+    static int ctz64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctzll(x);
+#else
+        int n = 0;
+        while (!(x & 1)) {
+            x >>= 1;
+            ++n;
+        }
+        return n;
+#endif
+    }
+
+    static int popcount64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_popcountll(x);
+#else
+        int n = 0;
+        for (; x; x &= x - 1) ++n;
+        return n;
+#endif
+    }
+};
+
+// Rows of a sealed segment grouped by Document::sourcePath (and aliases), sorted by path
+// so prefix filters resolve with one binary search.
+using SourceIndex = std::vector<std::pair<std::string, RowBitmap>>;
+
+// A run of index entries with fixed capacity. Entries [0, count) are visible
+// to readers; the writer fills slot `count` and then publishes it with a
+// release store, so searches never need a lock. Once sealed a segment only
+// changes through its tombstone bits. Rows with byte-identical content
+// share one vector; vector slots past the last one used are never touched.
+struct Segment {
+    // keepTermCounts: tokenize each row on push. Used for the mutable
+    // segment, which has no lexicon until it is sealed.
+    Segment(std::size_t cap, std::size_t d, bool keepTermCounts = false)
+        : capacity(cap), dim(d),
+          docs(new Document[cap]),
+          vectors(new float[cap * d]),
+          slots(new uint32_t[cap]),
+          norms(new float[cap]),
+          tombstones(new std::atomic<uint64_t>[(cap + 63) / 64]),
+          termCounts(keepTermCounts ? new TermCounts[cap] : nullptr) {
+        for (std::size_t w = 0; w < (cap + 63) / 64; ++w) {
+            tombstones[w].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    const std::size_t capacity;
+    const std::size_t dim;
+    std::unique_ptr<Document[]> docs;
+    std::unique_ptr<float[]> vectors;   // capacity * dim, one vector per slot
+    std::unique_ptr<uint32_t[]> slots;  // row -> vector slot
+    std::unique_ptr<float[]> norms;     // L2 norm of each row
+    std::unique_ptr<std::atomic<uint64_t>[]> tombstones;
+    std::unique_ptr<TermCounts[]> termCounts;
+    std::atomic<std::size_t> count{0};
+    std::atomic<std::size_t> dead{0};
+
+    // BM25 postings, attached once the rows are final (sealed/merged/loaded)
+    std::shared_ptr<const SegmentLexicon> lexicon() const {
+        return std::atomic_load(&lexicon_);
+    }
+    void setLexicon(std::shared_ptr<const SegmentLexicon> lex) {
+        std::atomic_store(&lexicon_, std::move(lex));
+    }
+
+    // per-source row bitmaps for filtered search, attached with the lexicon
+    std::shared_ptr<const SourceIndex> sources() const {
+        return std::atomic_load(&sources_);
+    }
+    void setSources(std::shared_ptr<const SourceIndex> src) {
+        std::atomic_store(&sources_, std::move(src));
+    }
+
+    std::size_t size() const { return count.load(std::memory_order_acquire); }
+    std::size_t liveCount() const { return size() - dead.load(std::memory_order_relaxed); }
+    const float* row(std::size_t i) const { return vectors.get() + std::size_t{slots[i]} * dim; }
+
+    bool isDead(std::size_t i) const {
+        return (tombstones[i >> 6].load(std::memory_order_acquire) >> (i & 63)) & 1u;
+    }
+
+    bool markDead(std::size_t i) {
+        uint64_t bit = uint64_t{1} << (i & 63);
+        uint64_t prev = tombstones[i >> 6].fetch_or(bit, std::memory_order_release);
+        if (prev & bit) return false;
+        dead.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Only called by the (single) writer while holding the write mutex.
+    // A row whose content is already in this segment reuses that row's
+    // vector instead of storing the embedding again.
+    void push(const Document& doc, const std::vector<float>& embedding) {
+        std::size_t i = count.load(std::memory_order_relaxed);
+        docs[i] = doc;
+        uint64_t h = hashBytes(doc.content.data(), doc.content.size());
+        auto [it, inserted] = rowByContent_.emplace(h, static_cast<uint32_t>(i));
+        if (!inserted && docs[it->second].content == doc.content) {
+            slots[i] = slots[it->second];
+            norms[i] = norms[it->second];
+        } else {
+            // new content (or a hash collision, which just isn't shared)
+            slots[i] = static_cast<uint32_t>(usedSlots_++);
+            std::copy(embedding.begin(), embedding.end(), vectors.get() + std::size_t{slots[i]} * dim);
+            double n = 0.0;
+            for (float v : embedding) n += static_cast<double>(v) * static_cast<double>(v);
+            norms[i] = static_cast<float>(std::sqrt(n));
+        }
+        if (termCounts) termCounts[i] = countTerms(doc.content);
+        count.store(i + 1, std::memory_order_release);
+    }
+
+    // The stored vector for `content`, if some row here has exactly that
+    // text. Writer only (the lookup table is not synchronized).
+    const float* findContent(const std::string& content) const {
+        auto it = rowByContent_.find(hashBytes(content.data(), content.size()));
+        if (it == rowByContent_.end() || docs[it->second].content != content) return nullptr;
+        return row(it->second);
+    }
+
+    std::size_t vectorCount() const { return usedSlots_; }
+
+private:
+    std::unordered_map<uint64_t, uint32_t> rowByContent_;   // content hash -> first row
+    std::size_t usedSlots_ = 0;
+    std::shared_ptr<const SegmentLexicon> lexicon_;
+    std::shared_ptr<const SourceIndex> sources_;
+};
+
+// The set of segments a reader sees. Snapshots are immutable; writers build
+// a new one and publish it with std::atomic_store.
+struct IndexSnapshot {
+    std::vector<std::shared_ptr<Segment>> sealed;
+    std::shared_ptr<Segment> active;   // mutable tail, may be null
+
+    template <typename Fn>
+    void forEachSegment(Fn&& fn) const {
+        for (const auto& s : sealed) fn(*s);
+        if (active) fn(*active);
+    }
+};
+
+class VectorIndex {
+public:
+    explicit VectorIndex(const SentraConfig& cfg)
+        : cfg_(cfg), snap_(std::make_shared<IndexSnapshot>()), wal_(cfg.walPath) {}
+
+    ~VectorIndex() {
+        waitForMerges();
+    }
+
+    // True if there is a checkpoint, or a WAL left by an interrupted build.
+    bool existsOnDisk() const {
+        // file_size reports a missing WAL as uintmax_t(-1), not 0
+        std::error_code ec;
+        auto walBytes = fs::file_size(cfg_.walPath, ec);
+        return (fs::exists(cfg_.indexPath) && fs::exists(cfg_.metaPath)) ||
+               (!ec && walBytes > 0);
+    }
+
+    void build(const std::vector<Document>& docs,
+                std::vector<std::vector<float>>&& embeddings) {
+        if (docs.empty()) {
+            throw std::runtime_error("No documents to build index.");
+        }
+        if (docs.size() != embeddings.size()) {
+            throw std::runtime_error("Docs and embeddings size mismatch");
+        }
+
+        // Determine the reference embedding dimension from the first non-empty one
+        std::size_t refDim = 0;
+        for (const auto& emb : embeddings) {
+            if (!emb.empty()) {
+                refDim = emb.size();
+                break;
+            }
+        }
+        if (refDim == 0) {
+            throw std::runtime_error("All embeddings are empty.");
+        }
+
+        auto seg = std::make_shared<Segment>(docs.size(), refDim);
+        for (size_t i = 0; i < docs.size(); ++i) {
+            auto& emb = embeddings[i];
+
+            if (emb.empty()) {
+                std::cerr << "[WARN] Skipping doc " << docs[i].id
+                        << " because embedding is empty.\n";
+                continue;
+            }
+
+            if (emb.size() != refDim) {
+                std::cerr << "[WARN] Skipping doc " << docs[i].id
+                        << " due to embedding dimension mismatch: "
+                        << emb.size() << " vs " << refDim << "\n";
+                continue;
+            }
+
+            seg->push(docs[i], emb);
+        }
+
+        if (seg->size() == 0) {
+            throw std::runtime_error("No valid entries after filtering embeddings.");
+        }
+        seg->setLexicon(buildLexicon(allRows(*seg)));
+        seg->setSources(buildSourceIndex(*seg));
+        replaceAll(std::move(seg));
+
+        // A full build supersedes anything logged against an older index.
+        // Its checkpoint takes an LSN past every WAL record, so committing
+        // it drops them all; a crash before that leaves the old checkpoint
+        // and WAL as they were.
+        {
+            std::lock_guard<std::mutex> lock(writeMu_);
+            for (const auto& payload : wal_.readFrom(lsn_)) {
+                uint64_t lsn = 0;
+                std::memcpy(&lsn, payload.data(), sizeof(lsn));
+                lsn_ = std::max(lsn_, lsn);
+            }
+        }
+        saveToDisk();
+    }
+
+    // Add a single entry to the mutable segment. The entry is in the WAL
+    // before it becomes visible, so a crash never loses a paid-for
+    // embedding. Full segments are sealed and handed to the merger.
+    bool append(const Document& doc, std::vector<float>&& embedding) {
+        std::lock_guard<std::mutex> lock(writeMu_);
+
+        if (embedding.empty()) {
+            std::cerr << "[WARN] Skipping doc " << doc.id
+                      << " because embedding is empty.\n";
+            return false;
+        }
+        if (dim_ != 0 && embedding.size() != dim_) {
+            std::cerr << "[WARN] Skipping doc " << doc.id
+                      << " due to embedding dimension mismatch: "
+                      << embedding.size() << " vs " << dim_ << "\n";
+            return false;
+        }
+
+        ByteWriter w;
+        w.put<uint64_t>(++lsn_);
+        w.put<uint8_t>(kWalAppend);
+        w.putString(doc.id);
+        w.putString(doc.sourcePath);
+        w.putString(doc.content);
+        w.putFloats(embedding);
+        w.put<uint32_t>(static_cast<uint32_t>(doc.aliasSources.size()));
+        for (const auto& alias : doc.aliasSources) w.putString(alias);
+        wal_.append(w.buf);
+
+        appendLocked(doc, embedding);
+        return true;
+    }
+
+    // Seal the mutable segment so it becomes eligible for merging.
+    void seal() {
+        std::lock_guard<std::mutex> lock(writeMu_);
+        auto snap = snapshot();
+        if (!snap->active || snap->active->size() == 0) return;
+        auto next = std::make_shared<IndexSnapshot>(*snap);
+        sealActive(*next);
+        next->active.reset();
+        publish(next);
+        scheduleMerge();
+    }
+
+    // Tombstone every entry that came from sourcePath. Searches skip them
+    // immediately; the memory is reclaimed when the segment is merged.
+    std::size_t removeSource(const std::string& sourcePath) {
+        std::lock_guard<std::mutex> lock(writeMu_);
+        logRemoval(kWalRemoveSource, sourcePath);
+        return removeLocked([&](const Document& d) { return d.sourcePath == sourcePath; });
+    }
+
+    bool remove(const std::string& id) {
+        std::lock_guard<std::mutex> lock(writeMu_);
+        logRemoval(kWalRemoveId, id);
+        return removeLocked([&](const Document& d) { return d.id == id; }) > 0;
+    }
+
+    // Live chunks grouped by source, in insertion order.
+    std::map<std::string, std::vector<Document>> documentsBySource() const {
+        std::map<std::string, std::vector<Document>> out;
+        snapshot()->forEachSegment([&](const Segment& seg) {
+            for (size_t i = 0, n = seg.size(); i < n; ++i) {
+                if (seg.isDead(i)) continue;
+                out[seg.docs[i].sourcePath].push_back(seg.docs[i]);
+            }
+        });
+        return out;
+    }
+
+    // Embeddings of the live chunks of one source, keyed by chunk text.
+    std::map<std::string, std::vector<float>> embeddingsForSource(const std::string& sourcePath) const {
+        std::map<std::string, std::vector<float>> out;
+        snapshot()->forEachSegment([&](const Segment& seg) {
+            for (size_t i = 0, n = seg.size(); i < n; ++i) {
+                if (seg.isDead(i) || seg.docs[i].sourcePath != sourcePath) continue;
+                out.emplace(seg.docs[i].content,
+                            std::vector<float>(seg.row(i), seg.row(i) + seg.dim));
+            }
+        });
+        return out;
+    }
+
+    // The embedding already stored for a chunk with exactly this text, in
+    // any segment, or empty if there is none.
+    std::vector<float> embeddingForContent(const std::string& content) const {
+        std::lock_guard<std::mutex> lock(writeMu_);
+        std::vector<float> out;
+        snapshot()->forEachSegment([&](const Segment& seg) {
+            if (!out.empty()) return;
+            if (const float* v = seg.findContent(content)) out.assign(v, v + seg.dim);
+        });
+        return out;
+    }
+
+    std::string allocateId() {
+        return "doc-" + std::to_string(nextDocNumber_.fetch_add(1));
+    }
+
+    std::size_t liveCount() const {
+        std::size_t n = 0;
+        snapshot()->forEachSegment([&](const Segment& seg) { n += seg.liveCount(); });
+        return n;
+    }
+
+    // Call fn(document, vector, dim) for every live entry.
+    template <typename Fn>
+    void forEachLive(Fn&& fn) const {
+        snapshot()->forEachSegment([&](const Segment& seg) {
+            for (size_t i = 0, n = seg.size(); i < n; ++i) {
+                if (!seg.isDead(i)) fn(seg.docs[i], seg.row(i), seg.dim);
+            }
+        });
+    }
+
+    // Distinct stored vectors (identical chunks in a segment share one).
+    std::size_t vectorCount() const {
+        std::size_t n = 0;
+        snapshot()->forEachSegment([&](const Segment& seg) { n += seg.vectorCount(); });
+        return n;
+    }
+
+    std::size_t segmentCount() const {
+        auto snap = snapshot();
+        return snap->sealed.size() + (snap->active ? 1 : 0);
+    }
+
+    void waitForMerges() {
+        std::future<void> pending;
+        {
+            std::lock_guard<std::mutex> lock(writeMu_);
+            pending = std::move(merger_);
+        }
+        if (pending.valid()) pending.wait();
+    }
+
+    // Write a checkpoint. Both files are written to .tmp siblings and then
+    // renamed into place, metadata first: once metadata.json is renamed the
+    // checkpoint is committed, and loadFromDisk() finishes a rename of
+    // index.bin that a crash interrupted. WAL records covered by the
+    // checkpoint are dropped afterwards.
+    void saveToDisk() {
+        std::lock_guard<std::mutex> checkpointLock(checkpointMu_);
+
+        // Capture a consistent (segments, row counts, lsn) triple; appends
+        // that land after this are left for the WAL.
+        std::vector<std::pair<std::shared_ptr<Segment>, size_t>> segs;
+        uint64_t lsn = 0;
+        {
+            std::lock_guard<std::mutex> lock(writeMu_);
+            lsn = lsn_;
+            auto snap = snapshot();
+            for (const auto& seg : snap->sealed) segs.emplace_back(seg, seg->size());
+            if (snap->active) segs.emplace_back(snap->active, snap->active->size());
+        }
+
+        // segments are flattened and dead entries are never written, so a
+        // reload starts as a single compacted segment
+        std::vector<std::pair<const Segment*, size_t>> rows;
+        for (const auto& [seg, n] : segs) {
+            for (size_t i = 0; i < n; ++i) {
+                if (!seg->isDead(i)) rows.emplace_back(seg.get(), i);
+            }
+        }
+        if (rows.empty()) {
+            throw std::runtime_error("No entries to save.");
+        }
+
+        fs::create_directories(cfg_.artifactsDir);
+        std::string indexTmp = cfg_.indexPath + ".tmp";
+        std::string metaTmp  = cfg_.metaPath + ".tmp";
+
+        // Save embeddings as binary
+        FILE* out = std::fopen(indexTmp.c_str(), "wb");
+        if (!out) {
+            throw std::runtime_error("Failed to open index file for writing");
+        }
+
+        uint32_t num = static_cast<uint32_t>(rows.size());
+        uint32_t dim = static_cast<uint32_t>(rows[0].first->dim);
+
+        bool ok = true;
+        ok &= std::fwrite(&kIndexMagic, sizeof(kIndexMagic), 1, out) == 1;
+        ok &= std::fwrite(&kIndexVersion, sizeof(kIndexVersion), 1, out) == 1;
+        ok &= std::fwrite(&lsn, sizeof(lsn), 1, out) == 1;
+        ok &= std::fwrite(&num, sizeof(num), 1, out) == 1;
+        ok &= std::fwrite(&dim, sizeof(dim), 1, out) == 1;
+        for (const auto& [seg, i] : rows) {
+            ok &= std::fwrite(seg->row(i), sizeof(float), dim, out) == dim;
+        }
+        syncFile(out);
+        ok = (std::fclose(out) == 0) && ok;
+        if (!ok) {
+            throw std::runtime_error("Failed to write index file: " + indexTmp);
+        }
+
+        // Save metadata as JSON
+        json docs = json::array();
+        for (const auto& [seg, i] : rows) {
+            const auto& d = seg->docs[i];
+            json entry = {
+                {"id",      d.id},
+                {"source",  d.sourcePath},
+                {"content", d.content}
+            };
+            if (!d.aliasSources.empty()) entry["aliases"] = d.aliasSources;
+            docs.push_back(std::move(entry));
+        }
+        json j = {{"lsn", lsn}, {"documents", std::move(docs)}};
+        writeStringToFileDurably(metaTmp, j.dump(2));
+
+        // BM25 postings for the same rows; tagged with the lsn so a stale
+        // file is rebuilt instead of used
+        ByteWriter lw;
+        lw.put(kLexicalMagic);
+        lw.put(lsn);
+        buildLexicon(rows)->serialize(lw);
+        writeStringToFileDurably(cfg_.lexicalPath + ".tmp", lw.buf);
+
+        commitFile(metaTmp, cfg_.metaPath);
+        commitFile(indexTmp, cfg_.indexPath);
+        commitFile(cfg_.lexicalPath + ".tmp", cfg_.lexicalPath);
+
+        std::lock_guard<std::mutex> lock(writeMu_);
+        wal_.truncate(lsn);
+    }
+
+    // Whether the WAL has grown enough since the last checkpoint to be
+    // worth folding into a new one (see checkpointWalRatio).
+    bool checkpointDue() const {
+        auto bytes = [](const std::string& path) {
+            std::error_code ec;
+            auto n = fs::file_size(path, ec);
+            return ec ? std::uintmax_t{0} : n;
+        };
+        std::uintmax_t checkpoint = bytes(cfg_.indexPath) + bytes(cfg_.metaPath);
+        auto threshold = std::max<std::uintmax_t>(
+            cfg_.checkpointMinWalBytes,
+            static_cast<std::uintmax_t>(cfg_.checkpointWalRatio * static_cast<double>(checkpoint)));
+        return bytes(cfg_.walPath) >= threshold;
+    }
+
+    // Whether this process holds the index writer lock. Read-only
+    // instances never touch the files they load.
+    void setWritable(bool writable) {
+        writable_ = writable;
+    }
+
+    // Load the last checkpoint and replay the WAL on top of it. A reader
+    // races the writer: a checkpoint committed between its reads of the
+    // checkpoint and the WAL truncates records the older checkpoint still
+    // needs. That shows as a gap before the first WAL record, or as a newer
+    // index.bin once the WAL is read, and the load starts over.
+    void loadFromDisk() {
+        if (writable_) finishInterruptedCheckpoint();
+
+        const int attempts = writable_ ? 1 : 5;
+        for (int attempt = 1; ; ++attempt) {
+            uint64_t indexLsn = 0;
+            std::shared_ptr<Segment> seg;
+            // without either file this is a build that crashed before its
+            // first checkpoint: WAL only
+            if (fs::exists(cfg_.indexPath) || fs::exists(cfg_.metaPath)) {
+                seg = readCheckpoint(indexLsn);
+            }
+            auto wal = wal_.readFrom(indexLsn, writable_);
+            uint64_t firstLsn = indexLsn + 1;
+            if (!wal.empty()) std::memcpy(&firstLsn, wal.front().data(), sizeof(firstLsn));
+            bool consistent = firstLsn == indexLsn + 1 && checkpointLsn() == indexLsn;
+
+            if (!consistent && attempt < attempts) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(20 * attempt));
+                continue;
+            }
+            if (!consistent && !writable_) {
+                throw std::runtime_error("Index changed on disk while loading");
+            }
+            if (!consistent) {
+                // nobody else writes while we hold the lock: the records
+                // are gone for good
+                std::cerr << "[WARN] WAL starts at LSN " << firstLsn << ", checkpoint is at "
+                          << indexLsn << "; mutations in between are lost\n";
+            }
+
+            if (seg) {
+                auto num = static_cast<uint32_t>(seg->size());
+                seg->setLexicon(loadLexicon(indexLsn, num));
+                if (!seg->lexicon()) {
+                    std::cerr << "Rebuilding lexical index.\n";
+                    seg->setLexicon(buildLexicon(allRows(*seg)));
+                }
+                seg->setSources(buildSourceIndex(*seg));
+                replaceAll(std::move(seg));
+            }
+
+            std::lock_guard<std::mutex> lock(writeMu_);
+            lsn_ = indexLsn;
+            for (const auto& payload : wal) replayLocked(payload);
+            if (!wal.empty()) {
+                std::cerr << "Recovered " << wal.size() << " index mutations from WAL.\n";
+            }
+            return;
+        }
+    }
+
+    // LSN in the header of the committed index.bin; 0 if there is none.
+    uint64_t checkpointLsn() const {
+        std::ifstream in(cfg_.indexPath, std::ios::binary);
+        if (!in) return 0;
+        uint64_t lsn = 0;
+        uint32_t num = 0, dim = 0;
+        readIndexHeader(in, lsn, num, dim);
+        return lsn;
+    }
+
+    // A reader can catch the writer between its renames of metadata.json
+    // and index.bin and see files from two checkpoints; it retries for a
+    // moment (the second rename follows right away) instead of failing.
+    // Nothing is published until a consistent pair has been read.
+    std::shared_ptr<Segment> readCheckpoint(uint64_t& lsn) const {
+        const int attempts = writable_ ? 1 : 5;
+        for (int attempt = 1; ; ++attempt) {
+            try {
+                return readCheckpointOnce(lsn);
+            } catch (const std::exception&) {
+                if (attempt >= attempts) throw;
+                std::this_thread::sleep_for(std::chrono::milliseconds(20 * attempt));
+            }
+        }
+    }
+
+    std::shared_ptr<Segment> readCheckpointOnce(uint64_t& lsn) const {
+        std::ifstream in(cfg_.indexPath, std::ios::binary);
+        if (!in) {
+            throw std::runtime_error("Failed to open index file");
+        }
+        uint32_t num = 0;
+        uint32_t dim = 0;
+        readIndexHeader(in, lsn, num, dim);
+
+        std::string metaStr = readFileToString(cfg_.metaPath);
+        json j = json::parse(metaStr);
+        uint64_t metaLsn = 0;
+        const json& docs = metadataDocuments(j, metaLsn);
+
+        if (docs.size() != num || metaLsn != lsn) {
+            throw std::runtime_error("Metadata size does not match index");
+        }
+
+        auto seg = std::make_shared<Segment>(num, dim);
+        std::vector<float> emb(dim);
+        for (uint32_t i = 0; i < num; ++i) {
+            Document d;
+            d.id         = docs[i]["id"].get<std::string>();
+            d.sourcePath = docs[i]["source"].get<std::string>();
+            d.content    = docs[i]["content"].get<std::string>();
+            if (docs[i].contains("aliases")) {
+                d.aliasSources = docs[i]["aliases"].get<std::vector<std::string>>();
+            }
+
+            in.read(reinterpret_cast<char*>(emb.data()),
+                    static_cast<std::streamsize>(dim * sizeof(float)));
+            if (!in) {
+                throw std::runtime_error("Index file is truncated");
+            }
+
+            seg->push(d, emb);
+        }
+        return seg;
+    }
+
+    // Top-k by cosine similarity, with scores. Segments the filter rules out
+    // entirely are skipped before any vector is touched.
+    std::vector<Candidate> search(const std::vector<float>& queryEmbedding,
+                                  int topK,
+                                  const SearchFilter& filter = {}) const {
+        return searchSegments(queryEmbedding, topK, -std::numeric_limits<float>::infinity(), filter);
+    }
+
+    // Up to maxK results with cosine similarity >= minScore, best first;
+    // empty when nothing in the index is that close to the query.
+    std::vector<Candidate> searchRange(const std::vector<float>& queryEmbedding,
+                                       float minScore, int maxK,
+                                       const SearchFilter& filter = {}) const {
+        return searchSegments(queryEmbedding, maxK, minScore, filter);
+    }
+
+    // BM25 keyword search over chunk text. Runs MaxScore on each sealed
+    // segment's postings and scores the mutable segment from its term
+    // counts; collection statistics are summed across segments and do not
+    // depend on the filter, so filtered scores match unfiltered ones.
+    std::vector<Candidate> searchLexical(const std::string& query, int topK,
+                                         const SearchFilter& filter = {}) const {
+        std::vector<uint64_t> terms;
+        forEachToken(query, [&](const std::string& t) { terms.push_back(hashTerm(t.data(), t.size())); });
+        std::sort(terms.begin(), terms.end());
+        terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+        if (terms.empty() || topK <= 0) return {};
+
+        auto snap = snapshot();
+
+        struct Part {
+            const Segment* seg;
+            std::shared_ptr<const SegmentLexicon> lex;
+            RowFilter allowed;
+            // mutable segment only: (row, length, tf per query term) of matching rows
+            std::vector<std::pair<uint32_t, uint32_t>> rows;
+            std::vector<std::vector<uint32_t>> tfs;
+        };
+        std::vector<Part> parts;
+        double docs = 0.0, totalLen = 0.0;
+        std::vector<double> df(terms.size(), 0.0);
+
+        snap->forEachSegment([&](const Segment& seg) {
+            Part part{&seg, seg.lexicon(), compileFilter(seg, filter), {}, {}};
+            if (part.lex) {
+                docs += static_cast<double>(part.lex->docLen.size());
+                totalLen += static_cast<double>(part.lex->totalLen);
+                for (size_t t = 0; t < terms.size(); ++t) {
+                    if (const auto* term = part.lex->find(terms[t])) df[t] += term->df;
+                }
+            } else if (seg.termCounts) {
+                for (size_t i = 0, n = seg.size(); i < n; ++i) {
+                    const TermCounts& tc = seg.termCounts[i];
+                    uint32_t len = termTotal(tc);
+                    docs += 1.0;
+                    totalLen += len;
+                    std::vector<uint32_t> tf(terms.size(), 0);
+                    bool any = false;
+                    for (size_t t = 0; t < terms.size(); ++t) {
+                        auto it = std::lower_bound(tc.begin(), tc.end(), std::make_pair(terms[t], uint32_t{0}));
+                        if (it != tc.end() && it->first == terms[t]) {
+                            tf[t] = it->second;
+                            df[t] += 1.0;
+                            any = true;
+                        }
+                    }
+                    if (any && part.allowed.allows(seg, i)) {
+                        part.rows.emplace_back(static_cast<uint32_t>(i), len);
+                        part.tfs.push_back(std::move(tf));
+                    }
+                }
+            } else {
+                return;   // not indexed yet (only while a segment is being built)
+            }
+            parts.push_back(std::move(part));
+        });
+        if (docs == 0.0) return {};
+
+        Bm25 bm;
+        bm.avgLen = static_cast<float>(std::max(totalLen / docs, 1.0));
+        std::vector<float> idf(terms.size());
+        for (size_t t = 0; t < terms.size(); ++t) idf[t] = Bm25::idf(docs, df[t]);
+
+        std::vector<Scored> scored;
+        for (const auto& part : parts) {
+            if (part.lex) {
+                if (part.allowed.none()) continue;
+                auto hits = maxScoreSegment(*part.seg, *part.lex, terms, idf, bm, topK, part.allowed);
+                scored.insert(scored.end(), hits.begin(), hits.end());
+                continue;
+            }
+            for (size_t k = 0; k < part.rows.size(); ++k) {
+                auto [row, len] = part.rows[k];
+                if (part.seg->isDead(row)) continue;
+                float score = 0.0f;
+                for (size_t t = 0; t < terms.size(); ++t) {
+                    if (part.tfs[k][t]) score += bm.score(idf[t], part.tfs[k][t], len);
+                }
+                scored.push_back({score, part.seg, row});
+            }
+        }
+
+        if (topK > static_cast<int>(scored.size())) {
+            topK = static_cast<int>(scored.size());
+        }
+        std::partial_sort(scored.begin(), scored.begin() + topK, scored.end(), byScoreDesc);
+        return toCandidates(scored, topK, snap);
+    }
+
+    // the similarity kernel used by the scan, also used to compare results
+    static float cosineSim(const float* a, float na, const float* b, float nb,
+                           std::size_t dim) {
+        if (na == 0.0f || nb == 0.0f) {
+            return 0.0f;
+        }
+        double dot = 0.0;
+        for (size_t i = 0; i < dim; ++i) {
+            dot += static_cast<double>(a[i]) * static_cast<double>(b[i]);
+        }
+        return static_cast<float>(dot / (static_cast<double>(na) * static_cast<double>(nb)));
+    }
+
+private:
+    struct Scored {
+        float score;
+        const Segment* seg;
+        size_t row;
+    };
+
+    // below this many entries a single-threaded scan is faster than fan-out
+    static constexpr std::size_t kParallelScanMin = 32768;
+
+    // index.bin header: magic, version, checkpoint lsn, num, dim. Files
+    // without the magic are the original (num, dim) format with lsn 0.
+    static constexpr uint32_t kIndexMagic   = 0x58544E53;   // "SNTX"
+    static constexpr uint32_t kIndexVersion = 2;
+    static constexpr std::size_t kIndexHeaderSize = 24;
+
+    static constexpr uint32_t kLexicalMagic = 0x584C4E53;   // "SNLX"
+
+    static constexpr uint8_t kWalAppend       = 1;
+    static constexpr uint8_t kWalRemoveSource = 2;
+    static constexpr uint8_t kWalRemoveId     = 3;
+
+    SentraConfig cfg_;
+    std::shared_ptr<const IndexSnapshot> snap_;   // access via snapshot()/publish()
+    mutable std::mutex writeMu_;                   // serializes writers; readers never take it
+    std::size_t dim_ = 0;
+    std::atomic<std::size_t> nextDocNumber_{0};
+    std::future<void> merger_;
+
+    bool writable_ = true;
+    WriteAheadLog wal_;            // guarded by writeMu_
+    uint64_t lsn_ = 0;             // last logged mutation, guarded by writeMu_
+    std::mutex checkpointMu_;      // one saveToDisk() at a time
+
+    static bool byScoreDesc(const Scored& a, const Scored& b) {
+        return a.score > b.score;
+    }
+
+    // `snap` is the snapshot the rows were scored in; each candidate holds
+    // on to it rather than copying the row out.
+    static std::vector<Candidate> toCandidates(const std::vector<Scored>& scored, int n,
+                                               const std::shared_ptr<const IndexSnapshot>& snap) {
+        std::vector<Candidate> result;
+        result.reserve(n);
+        for (int i = 0; i < n; ++i) {
+            const Segment& seg = *scored[i].seg;
+            std::size_t row = scored[i].row;
+            result.push_back({&seg.docs[row], scored[i].score, seg.row(row), seg.dim,
+                              seg.norms[row], snap});
+        }
+        return result;
+    }
+
+    std::shared_ptr<const IndexSnapshot> snapshot() const {
+        return std::atomic_load(&snap_);
+    }
+
+    void publish(std::shared_ptr<const IndexSnapshot> next) {
+        std::atomic_store(&snap_, std::move(next));
+    }
+
+    void replaceAll(std::shared_ptr<Segment> seg) {
+        waitForMerges();
+        std::lock_guard<std::mutex> lock(writeMu_);
+        auto next = std::make_shared<IndexSnapshot>();
+        dim_ = seg->dim;
+        nextDocNumber_ = 0;
+        for (size_t i = 0, n = seg->size(); i < n; ++i) {
+            noteDocId(seg->docs[i].id);
+        }
+        next->sealed.push_back(std::move(seg));
+        publish(std::move(next));
+    }
+
+    // Called with writeMu_ held.
+    void appendLocked(const Document& doc, const std::vector<float>& embedding) {
+        dim_ = embedding.size();
+        auto snap = snapshot();
+        if (!snap->active || snap->active->size() == snap->active->capacity) {
+            auto next = std::make_shared<IndexSnapshot>(*snap);
+            if (next->active) sealActive(*next);
+            next->active = std::make_shared<Segment>(cfg_.memtableSize, dim_, true);
+            publish(next);
+            snap = next;
+            scheduleMerge();
+        }
+
+        snap->active->push(doc, embedding);
+        noteDocId(doc.id);
+    }
+
+    // Move the mutable segment to the sealed list, with a lexicon built from
+    // the term counts collected on push (no re-tokenizing) and its source
+    // bitmaps. Called with
+    // writeMu_ held, on a snapshot that is not yet published.
+    void sealActive(IndexSnapshot& next) {
+        next.active->setLexicon(buildLexicon(allRows(*next.active)));
+        next.active->setSources(buildSourceIndex(*next.active));
+        next.sealed.push_back(next.active);
+    }
+
+    using RowList = std::vector<std::pair<const Segment*, size_t>>;
+
+    static std::shared_ptr<SourceIndex> buildSourceIndex(const Segment& seg) {
+        std::map<std::string, RowBitmap> bySource;
+        for (size_t i = 0, n = seg.size(); i < n; ++i) {
+            bySource[seg.docs[i].sourcePath].add(static_cast<uint32_t>(i));
+            for (const auto& alias : seg.docs[i].aliasSources) {
+                bySource[alias].add(static_cast<uint32_t>(i));
+            }
+        }
+        auto index = std::make_shared<SourceIndex>();
+        index->reserve(bySource.size());
+        for (auto& [source, rows] : bySource) index->emplace_back(source, std::move(rows));
+        return index;
+    }
+
+    // The rows of one segment a SearchFilter allows. Sealed segments union
+    // their precomputed per-source bitmaps; the mutable segment has none yet
+    // and tests each row's source instead.
+    struct RowFilter {
+        const SearchFilter* filter = nullptr;   // null: every row passes
+        bool compiled = false;
+        RowBitmap allowed;
+
+        bool none() const {
+            return compiled && allowed.cardinality() == 0;
+        }
+        bool allows(const Segment& seg, size_t row) const {
+            if (!filter) return true;
+            if (compiled) return allowed.contains(static_cast<uint32_t>(row));
+            return filter->matches(seg.docs[row]);
+        }
+    };
+
+    static RowFilter compileFilter(const Segment& seg, const SearchFilter& filter) {
+        RowFilter rf;
+        if (filter.empty()) return rf;
+        rf.filter = &filter;
+        auto sources = seg.sources();
+        if (!sources) return rf;
+        rf.compiled = true;
+        auto byPath = [](const std::pair<std::string, RowBitmap>& e, const std::string& p) {
+            return e.first < p;
+        };
+        for (const auto& path : filter.sources) {
+            auto it = std::lower_bound(sources->begin(), sources->end(), path, byPath);
+            if (it != sources->end() && it->first == path) rf.allowed.unionWith(it->second);
+        }
+        for (const auto& prefix : filter.pathPrefixes) {
+            auto it = std::lower_bound(sources->begin(), sources->end(), prefix, byPath);
+            for (; it != sources->end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+                rf.allowed.unionWith(it->second);
+            }
+        }
+        // rows deleted since the segment was sealed are still in its
+        // source bitmaps; taking them out lets a segment whose matching
+        // rows were all re-synced away be skipped outright
+        if (seg.dead.load(std::memory_order_relaxed) > 0 && !rf.none()) {
+            RowBitmap deadRows;
+            for (size_t w = 0, words = (seg.size() + 63) / 64; w < words; ++w) {
+                uint64_t word = seg.tombstones[w].load(std::memory_order_acquire);
+                for (int b = 0; word; ++b, word >>= 1) {
+                    if (word & 1u) deadRows.add(static_cast<uint32_t>(w * 64 + b));
+                }
+            }
+            rf.allowed.subtract(deadRows);
+        }
+        return rf;
+    }
+
+    static RowList allRows(const Segment& seg) {
+        RowList rows;
+        for (size_t i = 0, n = seg.size(); i < n; ++i) rows.emplace_back(&seg, i);
+        return rows;
+    }
+
+    // Build the lexicon for a new segment whose row r is rows[r]. Rows that
+    // come from a segment with a lexicon are remapped from its postings;
+    // others use their term counts, or are tokenized as a last resort.
+    static std::shared_ptr<SegmentLexicon> buildLexicon(const RowList& rows) {
+        LexiconBuilder builder(rows.size());
+        size_t k = 0;
+        while (k < rows.size()) {
+            const Segment* seg = rows[k].first;
+            size_t end = k;
+            while (end < rows.size() && rows[end].first == seg) ++end;
+
+            auto lex = seg->lexicon();
+            if (lex) {
+                std::vector<int64_t> remap(lex->docLen.size(), -1);
+                for (size_t r = k; r < end; ++r) {
+                    remap[rows[r].second] = static_cast<int64_t>(r);
+                    builder.setDocLen(static_cast<uint32_t>(r), lex->docLen[rows[r].second]);
+                }
+                for (const auto& t : lex->terms) {
+                    const char* p = lex->postings.data() + t.offset;
+                    const char* stop = p + t.bytes;
+                    uint32_t row = 0;
+                    while (p < stop) {
+                        row += getVarint(p);
+                        uint32_t tf = getVarint(p);
+                        if (remap[row] >= 0) builder.add(t.hash, static_cast<uint32_t>(remap[row]), tf);
+                    }
+                }
+            } else {
+                for (size_t r = k; r < end; ++r) {
+                    size_t i = rows[r].second;
+                    builder.addDoc(static_cast<uint32_t>(r),
+                                   seg->termCounts ? seg->termCounts[i] : countTerms(seg->docs[i].content));
+                }
+            }
+            k = end;
+        }
+        return builder.finish();
+    }
+
+    // MaxScore top-k over one segment's postings: lists are ordered by
+    // their score upper bound, and once the running k-th best score exceeds
+    // the summed bounds of the weakest lists, those lists are only probed
+    // for candidates found through the others.
+    std::vector<Scored> maxScoreSegment(const Segment& seg, const SegmentLexicon& lex,
+                                        const std::vector<uint64_t>& terms,
+                                        const std::vector<float>& idf,
+                                        const Bm25& bm, int topK,
+                                        const RowFilter& allowed) const {
+        struct Cursor {
+            const char* p;
+            const char* end;
+            float idf;
+            float bound;
+            uint32_t row = 0;
+            uint32_t tf = 0;
+            bool done = false;
+
+            void next() {
+                if (p == end) {
+                    done = true;
+                    return;
+                }
+                row += getVarint(p);
+                tf = getVarint(p);
+            }
+            void seek(uint32_t target) {
+                while (!done && row < target) next();
+            }
+        };
+
+        std::vector<Cursor> cur;
+        for (size_t t = 0; t < terms.size(); ++t) {
+            const auto* term = lex.find(terms[t]);
+            if (!term) continue;
+            const char* p = lex.postings.data() + term->offset;
+            Cursor c{p, p + term->bytes, idf[t], bm.score(idf[t], term->maxTf, term->minLen)};
+            c.next();
+            cur.push_back(c);
+        }
+        if (cur.empty()) return {};
+
+        std::sort(cur.begin(), cur.end(),
+                  [](const Cursor& a, const Cursor& b) { return a.bound < b.bound; });
+        std::vector<float> prefix(cur.size());
+        for (size_t i = 0; i < cur.size(); ++i) {
+            prefix[i] = cur[i].bound + (i ? prefix[i - 1] : 0.0f);
+        }
+
+        auto worse = [](const Scored& a, const Scored& b) { return a.score > b.score; };
+        std::vector<Scored> heap;   // min-heap on score
+        float theta = 0.0f;
+        size_t essential = 0;       // cur[essential..] drive candidate selection
+
+        while (true) {
+            uint32_t d = std::numeric_limits<uint32_t>::max();
+            for (size_t i = essential; i < cur.size(); ++i) {
+                if (!cur[i].done) d = std::min(d, cur[i].row);
+            }
+            if (d == std::numeric_limits<uint32_t>::max()) break;
+
+            uint32_t len = lex.docLen[d];
+            float score = 0.0f;
+            for (size_t i = essential; i < cur.size(); ++i) {
+                if (!cur[i].done && cur[i].row == d) {
+                    score += bm.score(cur[i].idf, cur[i].tf, len);
+                    cur[i].next();
+                }
+            }
+            for (size_t i = essential; i-- > 0;) {
+                if (score + prefix[i] <= theta) break;
+                cur[i].seek(d);
+                if (!cur[i].done && cur[i].row == d) {
+                    score += bm.score(cur[i].idf, cur[i].tf, len);
+                }
+            }
+
+            bool full = static_cast<int>(heap.size()) >= topK;
+            if ((full && score <= theta) || seg.isDead(d) || !allowed.allows(seg, d)) continue;
+
+            heap.push_back({score, &seg, d});
+            std::push_heap(heap.begin(), heap.end(), worse);
+            if (static_cast<int>(heap.size()) > topK) {
+                std::pop_heap(heap.begin(), heap.end(), worse);
+                heap.pop_back();
+            }
+            if (static_cast<int>(heap.size()) == topK) {
+                theta = heap.front().score;
+                while (essential < cur.size() && prefix[essential] <= theta) ++essential;
+            }
+        }
+        return heap;
+    }
+
+    // Called with writeMu_ held.
+    template <typename Pred>
+    std::size_t removeLocked(Pred&& matches) {
+        std::size_t removed = 0;
+        snapshot()->forEachSegment([&](Segment& seg) {
+            for (size_t i = 0, n = seg.size(); i < n; ++i) {
+                if (matches(seg.docs[i]) && seg.markDead(i)) ++removed;
+            }
+        });
+        if (removed > 0) scheduleMerge();
+        return removed;
+    }
+
+    void logRemoval(uint8_t type, const std::string& key) {
+        ByteWriter w;
+        w.put<uint64_t>(++lsn_);
+        w.put<uint8_t>(type);
+        w.putString(key);
+        wal_.append(w.buf);
+    }
+
+    // Apply one WAL record without logging it again. Called with writeMu_ held.
+    void replayLocked(const std::string& payload) {
+        ByteReader r{payload.data(), payload.data() + payload.size()};
+        lsn_ = r.get<uint64_t>();
+        uint8_t type = r.get<uint8_t>();
+        if (type == kWalAppend) {
+            Document d;
+            d.id         = r.getString();
+            d.sourcePath = r.getString();
+            d.content    = r.getString();
+            std::vector<float> emb = r.getFloats();
+            if (r.p != r.end) {   // records written before aliases have none
+                uint32_t n = r.get<uint32_t>();
+                for (uint32_t k = 0; k < n; ++k) d.aliasSources.push_back(r.getString());
+            }
+            if (!emb.empty() && (dim_ == 0 || emb.size() == dim_)) {
+                appendLocked(d, emb);
+            }
+        } else if (type == kWalRemoveSource) {
+            std::string source = r.getString();
+            removeLocked([&](const Document& d) { return d.sourcePath == source; });
+        } else if (type == kWalRemoveId) {
+            std::string id = r.getString();
+            removeLocked([&](const Document& d) { return d.id == id; });
+        } else {
+            throw std::runtime_error("Unknown WAL record type");
+        }
+    }
+
+    static void readIndexHeader(std::istream& in, uint64_t& lsn, uint32_t& num, uint32_t& dim) {
+        uint32_t first = 0;
+        in.read(reinterpret_cast<char*>(&first), sizeof(first));
+        if (first == kIndexMagic) {
+            uint32_t version = 0;
+            in.read(reinterpret_cast<char*>(&version), sizeof(version));
+            if (version != kIndexVersion) {
+                throw std::runtime_error("Unsupported index file version");
+            }
+            in.read(reinterpret_cast<char*>(&lsn), sizeof(lsn));
+            in.read(reinterpret_cast<char*>(&num), sizeof(num));
+        } else {
+            lsn = 0;
+            num = first;
+        }
+        in.read(reinterpret_cast<char*>(&dim), sizeof(dim));
+        if (!in) {
+            throw std::runtime_error("Index file header is truncated");
+        }
+    }
+
+    // lexical.bin for checkpoint `lsn`, or null if missing, stale or corrupt.
+    std::shared_ptr<SegmentLexicon> loadLexicon(uint64_t lsn, uint32_t rows) const {
+        try {
+            if (!fs::exists(cfg_.lexicalPath)) return nullptr;
+            std::string data = readFileToString(cfg_.lexicalPath);
+            ByteReader r{data.data(), data.data() + data.size()};
+            if (r.get<uint32_t>() != kLexicalMagic || r.get<uint64_t>() != lsn) return nullptr;
+            auto lex = SegmentLexicon::deserialize(r);
+            return lex->docLen.size() == rows ? lex : nullptr;
+        } catch (const std::exception&) {
+            return nullptr;
+        }
+    }
+
+    // metadata.json is {"lsn": N, "documents": [...]}; older files are a bare array.
+    static const json& metadataDocuments(const json& j, uint64_t& lsn) {
+        if (j.is_array()) {
+            lsn = 0;
+            return j;
+        }
+        lsn = j.value("lsn", uint64_t{0});
+        return j.at("documents");
+    }
+
+    // A crash between the two renames in saveToDisk() leaves the committed
+    // metadata.json next to an index.bin.tmp with the same lsn; finish the
+    // job. Any other leftover .tmp is from an uncommitted checkpoint.
+    void finishInterruptedCheckpoint() {
+        std::string indexTmp = cfg_.indexPath + ".tmp";
+        std::string metaTmp  = cfg_.metaPath + ".tmp";
+        std::error_code ec;
+
+        if (fs::exists(indexTmp) && fs::exists(cfg_.metaPath)) {
+            try {
+                uint64_t tmpLsn = 0, metaLsn = 0;
+                uint32_t num = 0, dim = 0;
+                std::ifstream tin(indexTmp, std::ios::binary);
+                readIndexHeader(tin, tmpLsn, num, dim);
+                tin.close();
+
+                json j = json::parse(readFileToString(cfg_.metaPath));
+                metadataDocuments(j, metaLsn);
+
+                bool curMatches = false;
+                if (fs::exists(cfg_.indexPath)) {
+                    uint64_t curLsn = 0;
+                    uint32_t curNum = 0, curDim = 0;
+                    std::ifstream cin(cfg_.indexPath, std::ios::binary);
+                    readIndexHeader(cin, curLsn, curNum, curDim);
+                    curMatches = (curLsn == metaLsn);
+                }
+                uintmax_t expected = kIndexHeaderSize +
+                                     static_cast<uintmax_t>(num) * dim * sizeof(float);
+                if (!curMatches && tmpLsn == metaLsn &&
+                    fs::file_size(indexTmp) == expected) {
+                    std::cerr << "Completing interrupted index checkpoint.\n";
+                    commitFile(indexTmp, cfg_.indexPath);
+                }
+            } catch (const std::exception& ex) {
+                std::cerr << "[WARN] Ignoring partial checkpoint: " << ex.what() << "\n";
+            }
+        }
+        fs::remove(indexTmp, ec);
+        fs::remove(metaTmp, ec);
+        fs::remove(cfg_.lexicalPath + ".tmp", ec);
+    }
+
+    // Shared by search and searchRange.
+    std::vector<Candidate> searchSegments(const std::vector<float>& queryEmbedding,
+                                          int topK, float minScore,
+                                          const SearchFilter& filter) const {
+        auto snap = snapshot();
+
+        std::vector<const Segment*> segs;
+        std::vector<RowFilter> rowFilters;
+        std::size_t total = 0;
+        bool anyLive = false;
+        snap->forEachSegment([&](const Segment& seg) {
+            if (seg.liveCount() == 0) return;
+            anyLive = true;
+            RowFilter rf = compileFilter(seg, filter);
+            if (rf.none()) return;
+            total += rf.compiled ? rf.allowed.cardinality() : seg.size();
+            segs.push_back(&seg);
+            rowFilters.push_back(std::move(rf));
+        });
+        if (!anyLive) {
+            throw std::runtime_error("Index is empty.");
+        }
+        if (segs.empty()) return {};
+
+        // Fan out across segments (in parallel once the index is large
+        // enough to pay for the threads), then merge the per-segment top-k.
+        std::vector<std::vector<Scored>> partial(segs.size());
+        if (segs.size() > 1 && total >= kParallelScanMin) {
+            std::vector<std::future<void>> jobs;
+            uint64_t query = Tracer::currentQuery();
+            for (size_t s = 1; s < segs.size(); ++s) {
+                jobs.push_back(std::async(std::launch::async, [&, s, query]() {
+                    TraceQueryScope scope(query);
+                    partial[s] = scanSegment(*segs[s], queryEmbedding, topK, minScore, rowFilters[s]);
+                }));
+            }
+            partial[0] = scanSegment(*segs[0], queryEmbedding, topK, minScore, rowFilters[0]);
+            for (auto& j : jobs) j.get();
+        } else {
+            for (size_t s = 0; s < segs.size(); ++s) {
+                partial[s] = scanSegment(*segs[s], queryEmbedding, topK, minScore, rowFilters[s]);
+            }
+        }
+
+        std::vector<Scored> scored;
+        for (auto& p : partial) {
+            scored.insert(scored.end(), p.begin(), p.end());
+        }
+
+        if (topK > static_cast<int>(scored.size())) {
+            topK = static_cast<int>(scored.size());
+        }
+
+        std::partial_sort(scored.begin(), scored.begin() + topK, scored.end(), byScoreDesc);
+        return toCandidates(scored, topK, snap);
+    }
+
+    std::vector<Scored> scanSegment(const Segment& seg,
+                                    const std::vector<float>& q,
+                                    int topK, float minScore,
+                                    const RowFilter& allowed) const {
+        std::vector<Scored> scored;
+        std::size_t n = seg.size();
+        TraceSpan span("scan_segment", "search");
+        if (Tracer::active()) span.setDetail("rows=" + std::to_string(n));
+
+        double qn = 0.0;
+        for (float v : q) qn += static_cast<double>(v) * static_cast<double>(v);
+        float qNorm = static_cast<float>(std::sqrt(qn));
+
+        auto scoreRow = [&](size_t i) {
+            if (seg.isDead(i)) return;
+            float s = 0.0f;
+            if (q.size() == seg.dim) {
+                s = cosineSim(q.data(), qNorm, seg.row(i), seg.norms[i], seg.dim);
+            }
+            if (s >= minScore) scored.push_back({s, &seg, i});
+        };
+
+        if (allowed.compiled) {
+            // visit only the rows of matching sources
+            scored.reserve(allowed.allowed.cardinality());
+            allowed.allowed.forEach([&](uint32_t row) {
+                if (row < n) scoreRow(row);
+            });
+        } else {
+            scored.reserve(n);
+            for (size_t i = 0; i < n; ++i) {
+                if (allowed.allows(seg, i)) scoreRow(i);
+            }
+        }
+
+        if (static_cast<int>(scored.size()) > topK) {
+            std::partial_sort(scored.begin(), scored.begin() + topK, scored.end(), byScoreDesc);
+            scored.resize(topK);
+        }
+        return scored;
+    }
+
+    // ---- background merging ----
+
+    // Called with writeMu_ held. Starts a merge pass unless one is running.
+    void scheduleMerge() {
+        if (merger_.valid() &&
+            merger_.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            return;
+        }
+        merger_ = std::async(std::launch::async, [this]() {
+            try {
+                while (mergeOnce()) {
+                }
+            } catch (const std::exception& ex) {
+                std::cerr << "[WARN] Segment merge failed: " << ex.what() << "\n";
+            }
+        });
+    }
+
+    // Pick one merge: a run of mergeFanIn adjacent small segments, or a
+    // single segment whose dead fraction crossed compactionThreshold.
+    // Returns false when there is nothing left to do.
+    bool mergeOnce() {
+        auto snap = snapshot();
+        const auto& sealed = snap->sealed;
+
+        std::size_t first = 0, last = 0;   // [first, last)
+        bool found = false;
+        for (size_t i = 0; i < sealed.size() && !found; ++i) {
+            const Segment& s = *sealed[i];
+            double garbage = s.size() ? static_cast<double>(s.dead.load()) / s.size() : 0.0;
+            if (garbage >= cfg_.compactionThreshold) {
+                first = i;
+                last = i + 1;
+                found = true;
+            }
+        }
+        for (size_t i = 0; i < sealed.size() && !found; ++i) {
+            size_t j = i;
+            while (j < sealed.size() && sealed[j]->liveCount() < cfg_.smallSegmentSize) ++j;
+            if (j - i >= static_cast<size_t>(cfg_.mergeFanIn)) {
+                first = i;
+                last = j;
+                found = true;
+            }
+            i = j;
+        }
+        if (!found) return false;
+
+        // Copy the live rows without holding any lock.
+        std::size_t live = 0;
+        for (size_t s = first; s < last; ++s) live += sealed[s]->liveCount();
+        auto merged = std::make_shared<Segment>(std::max<std::size_t>(live, 1), sealed[first]->dim);
+        std::vector<std::pair<const Segment*, size_t>> origin;
+        origin.reserve(live);
+        for (size_t s = first; s < last; ++s) {
+            const Segment& seg = *sealed[s];
+            std::vector<float> emb(seg.dim);
+            for (size_t i = 0, n = seg.size(); i < n; ++i) {
+                if (seg.isDead(i) || merged->size() == merged->capacity) continue;
+                std::copy(seg.row(i), seg.row(i) + seg.dim, emb.begin());
+                merged->push(seg.docs[i], emb);
+                origin.emplace_back(&seg, i);
+            }
         }
 
-        std::string prompt =
-            "You are SentraAI, a retrieval-augmented assistant. "
-            "Use the provided context when it is relevant to the user's question. "
-            "If the question is generic small talk (like 'hello'), you may respond normally. "
-            "If the user asks about specific facts not in the context, say you don't know.\n\n"
-            "Context:\n" + contextText + "\nQuestion:\n" + question + "\n\nAnswer:";
+        merged->setLexicon(buildLexicon(origin));
+        merged->setSources(buildSourceIndex(*merged));
 
-        json body;
-        body["model"] = cfg_.chatModel;
-        body["messages"] = json::array({
-            json{{"role", "system"}, {"content", "You are a helpful assistant."}},
-            json{{"role", "user"},   {"content", prompt}}
-        });
+        std::lock_guard<std::mutex> lock(writeMu_);
+        auto cur = snapshot();
+        // Deletes are applied under writeMu_, so re-checking the inputs
+        // here catches every tombstone set while we were copying.
+        for (size_t k = 0; k < origin.size(); ++k) {
+            if (origin[k].first->isDead(origin[k].second)) merged->markDead(k);
+        }
 
-        std::string respStr = http_.postJson("/chat/completions", body.dump());
-        json resp = json::parse(respStr);
-        // DEBUG: print raw response once
-        if(DEBUG_CHAT) {
-            std::cerr << "Chat raw response:\n" << resp.dump(2) << "\n";
+        auto next = std::make_shared<IndexSnapshot>();
+        next->active = cur->active;
+        bool replaced = false;
+        for (const auto& s : cur->sealed) {
+            bool input = false;
+            for (size_t i = first; i < last; ++i) {
+                if (s == sealed[i]) input = true;
+            }
+            if (!input) {
+                next->sealed.push_back(s);
+            } else if (!replaced) {
+                if (merged->liveCount() > 0) next->sealed.push_back(merged);
+                replaced = true;
+            }
         }
+        if (!replaced) return false;   // the index was replaced underneath us
 
+        if (DEBUG_CHAT) {
+            std::cerr << "Merged " << (last - first) << " segments -> "
+                      << merged->liveCount() << " entries\n";
+        }
+        publish(std::move(next));
+        return true;
+    }
 
-        std::string answer =
-            resp["choices"][0]["message"]["content"].get<std::string>();
-        return answer;
+    // keep allocateId() ahead of every "doc-N" id already in the index
+    void noteDocId(const std::string& id) {
+        if (id.rfind("doc-", 0) != 0) return;
+        try {
+            std::size_t n = std::stoul(id.substr(4)) + 1;
+            std::size_t cur = nextDocNumber_.load();
+            while (cur < n && !nextDocNumber_.compare_exchange_weak(cur, n)) {
+            }
+        } catch (const std::exception&) {
+        }
     }
 
-private:
-    SentraConfig cfg_;
-    HttpClient& http_;
 };
 
-// ---------------------- Vector Index (storage + cosine search) ----------------------
+// ---------------------- Retrieval fusion ----------------------
 
-class VectorIndex {
-public:
-    explicit VectorIndex(const SentraConfig& cfg) : cfg_(cfg) {}
+enum class FusionMode { ReciprocalRank, WeightedSum };
 
-    bool existsOnDisk() const {
-        return fs::exists(cfg_.indexPath) && fs::exists(cfg_.metaPath);
+FusionMode parseFusionMode(const std::string& name) {
+    if (name == "rrf") return FusionMode::ReciprocalRank;
+    if (name == "weighted") return FusionMode::WeightedSum;
+    throw std::runtime_error("Unknown fusion mode: " + name);
+}
+
+// One candidate source for the fusion stage. `retrieve` returns up to k
+// candidates, best first; a retriever that has not finished by its
+// deadline is left out of the fused result. Gate retrievers judge whether
+// the query has relevant context at all: a gate vouches for it when its
+// list passes `vouches` (by default, when it is non-empty), and when
+// every gate finishes without vouching the fused result is empty.
+struct Retriever {
+    std::string name;
+    float weight = 1.0f;
+    std::chrono::milliseconds deadline{1000};
+    std::function<std::vector<Candidate>(int k)> retrieve;
+    bool gate = false;
+    std::function<bool(const std::vector<Candidate>&)> vouches = nullptr;
+};
+
+// Whether a hit contains, verbatim, a token of the question that mixes
+// letters and digits (a part number, model or version). Such a hit is
+// relevant however far its embedding is from the question's.
+bool hasExactIdentifierHit(const std::string& question, const std::vector<Candidate>& hits) {
+    std::vector<std::string> identifiers;
+    forEachToken(question, [&](const std::string& t) {
+        bool digit = std::any_of(t.begin(), t.end(), [](unsigned char c) { return std::isdigit(c) != 0; });
+        bool alpha = std::any_of(t.begin(), t.end(), [](unsigned char c) { return std::isalpha(c) != 0; });
+        if (digit && alpha) identifiers.push_back(t);
+    });
+    if (identifiers.empty()) return false;
+    for (const auto& hit : hits) {
+        bool found = false;
+        forEachToken(std::string(hit.content()), [&](const std::string& t) {
+            found = found || std::find(identifiers.begin(), identifiers.end(), t) != identifiers.end();
+        });
+        if (found) return true;
     }
+    return false;
+}
 
-    void build(const std::vector<Document>& docs,
-                std::vector<std::vector<float>>&& embeddings) {
-        if (docs.empty()) {
-            throw std::runtime_error("No documents to build index.");
-        }
-        if (docs.size() != embeddings.size()) {
-            throw std::runtime_error("Docs and embeddings size mismatch");
+// Merge ranked lists (weight, candidates) into one top-k in a single pass.
+// Reciprocal rank fusion scores a chunk sum(w / (60 + rank)); weighted
+// mode min-max normalizes each list's scores to [0, 1] and sums w * score.
+std::vector<Candidate> fuseCandidates(
+        const std::vector<std::pair<float, std::vector<Candidate>>>& lists,
+        FusionMode mode, int topK) {
+    constexpr float kRrfK = 60.0f;
+
+    std::unordered_map<std::string_view, size_t> slot;
+    std::vector<Candidate> fused;
+    for (const auto& [weight, list] : lists) {
+        float lo = 0.0f, hi = 0.0f;
+        if (!list.empty()) {
+            auto [mn, mx] = std::minmax_element(list.begin(), list.end(),
+                [](const Candidate& a, const Candidate& b) { return a.score < b.score; });
+            lo = mn->score;
+            hi = mx->score;
         }
 
-        // Determine the reference embedding dimension from the first non-empty one
-        std::size_t refDim = 0;
-        for (const auto& emb : embeddings) {
-            if (!emb.empty()) {
-                refDim = emb.size();
-                break;
+        for (size_t rank = 0; rank < list.size(); ++rank) {
+            const Candidate& c = list[rank];
+            float contribution = 0.0f;
+            if (mode == FusionMode::ReciprocalRank) {
+                contribution = weight / (kRrfK + static_cast<float>(rank + 1));
+            } else {
+                contribution = weight * (hi > lo ? (c.score - lo) / (hi - lo) : 1.0f);
+            }
+
+            auto [it, inserted] = slot.emplace(c.id(), fused.size());
+            if (inserted) {
+                fused.push_back(c);
+                fused.back().score = contribution;
+            } else {
+                fused[it->second].score += contribution;
             }
         }
-        if (refDim == 0) {
-            throw std::runtime_error("All embeddings are empty.");
-        }
+    }
 
-        entries_.clear();
-        entries_.reserve(docs.size());
+    auto n = std::min<std::size_t>(static_cast<std::size_t>(std::max(topK, 0)), fused.size());
+    std::partial_sort(fused.begin(), fused.begin() + n, fused.end(),
+                      [](const Candidate& a, const Candidate& b) { return a.score > b.score; });
+    fused.resize(n);
+    return fused;
+}
 
-        for (size_t i = 0; i < docs.size(); ++i) {
-            auto& emb = embeddings[i];
+// Maximal marginal relevance: greedily pick k candidates, each maximizing
+// lambda * relevance - (1 - lambda) * (highest similarity to one already
+// picked). Relevance is the candidate's score min-max scaled to [0, 1] so
+// it is comparable with cosine similarity whatever produced it.
+std::vector<Candidate> diversifyMmr(std::vector<Candidate> pool, int k, float lambda) {
+    auto n = std::min<std::size_t>(static_cast<std::size_t>(std::max(k, 0)), pool.size());
+    if (pool.empty()) return pool;
 
-            if (emb.empty()) {
-                std::cerr << "[WARN] Skipping doc " << docs[i].id
-                        << " because embedding is empty.\n";
-                continue;
-            }
+    auto [mn, mx] = std::minmax_element(pool.begin(), pool.end(),
+        [](const Candidate& a, const Candidate& b) { return a.score < b.score; });
+    float lo = mn->score, hi = mx->score;
+    std::vector<float> relevance(pool.size());
+    for (size_t i = 0; i < pool.size(); ++i) {
+        relevance[i] = hi > lo ? (pool[i].score - lo) / (hi - lo) : 1.0f;
+    }
 
-            if (emb.size() != refDim) {
-                std::cerr << "[WARN] Skipping doc " << docs[i].id
-                        << " due to embedding dimension mismatch: "
-                        << emb.size() << " vs " << refDim << "\n";
-                continue;
+    // maxSim[i]: highest similarity of pool[i] to anything picked so far
+    std::vector<float> maxSim(pool.size(), 0.0f);
+    std::vector<bool> taken(pool.size(), false);
+    std::vector<Candidate> picked;
+    picked.reserve(n);
+    while (picked.size() < n) {
+        size_t best = pool.size();
+        float bestValue = 0.0f;
+        for (size_t i = 0; i < pool.size(); ++i) {
+            if (taken[i]) continue;
+            float value = lambda * relevance[i] - (1.0f - lambda) * maxSim[i];
+            if (best == pool.size() || value > bestValue) {
+                best = i;
+                bestValue = value;
             }
-
-            IndexEntry e;
-            e.doc = docs[i];
-            e.embedding = std::move(emb);
-            entries_.push_back(std::move(e));
         }
-
-        if (entries_.empty()) {
-            throw std::runtime_error("No valid entries after filtering embeddings.");
+        taken[best] = true;
+        const Candidate& chosen = pool[best];
+        for (size_t i = 0; i < pool.size(); ++i) {
+            if (taken[i] || pool[i].dim != chosen.dim) continue;
+            float sim = VectorIndex::cosineSim(pool[i].embedding, pool[i].norm,
+                                               chosen.embedding, chosen.norm, chosen.dim);
+            maxSim[i] = std::max(maxSim[i], sim);
         }
+        picked.push_back(std::move(pool[best]));
     }
+    return picked;
+}
 
+// ---------------------- Near-duplicate detection ----------------------
 
-    void saveToDisk() const {
-        if (entries_.empty()) {
-            throw std::runtime_error("No entries to save.");
-        }
-
-        fs::create_directories(cfg_.artifactsDir);
+// 64-bit SimHash over a chunk's tokens and adjacent token pairs: each
+// feature hash votes on every bit, and the sign of the tally is the bit.
+// Chunks that differ in a few words end up a few bits apart. `tokens`
+// receives the number of tokens hashed.
+uint64_t simHash(const std::string& text, std::size_t* tokens = nullptr) {
+    auto mix = [](uint64_t x) {   // splitmix64 finalizer
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    };
+    int tally[64] = {};
+    uint64_t prev = 0;
+    std::size_t count = 0;
+    auto vote = [&](uint64_t h) {
+        for (int b = 0; b < 64; ++b) tally[b] += ((h >> b) & 1u) ? 1 : -1;
+    };
+    forEachToken(text, [&](const std::string& t) {
+        uint64_t h = mix(hashTerm(t.data(), t.size()));
+        vote(h);
+        if (count > 0) vote(mix(prev * 31 + h));
+        prev = h;
+        ++count;
+    });
+    uint64_t sig = 0;
+    for (int b = 0; b < 64; ++b) {
+        if (tally[b] > 0) sig |= uint64_t{1} << b;
+    }
+    if (tokens) *tokens = count;
+    return sig;
+}
 
-        // Save embeddings as binary
-        std::ofstream out(cfg_.indexPath, std::ios::binary);
-        if (!out) {
-            throw std::runtime_error("Failed to open index file for writing");
-        }
+// Collapse chunks whose SimHash is within maxDistance bits of an earlier
+// chunk into that chunk, recording the dropped chunk's source as an alias.
+// Signatures are computed in parallel. Candidates come from LSH banding:
+// the 64 bits are cut into maxDistance + 1 bands, so any two signatures
+// within the distance agree exactly on at least one band. Each chunk is
+// compared only with kept chunks (no chaining through dropped ones), so
+// the result depends only on document order. Chunks of fewer than
+// minTokens tokens only collapse into an identical chunk, since on short
+// text a few bits can be the one token that tells two chunks apart.
+// Returns the number dropped.
+std::size_t collapseNearDuplicates(std::vector<Document>& docs, int maxDistance,
+                                   std::size_t minTokens = 0) {
+    if (maxDistance < 0 || docs.size() < 2) return 0;
+    std::stable_sort(docs.begin(), docs.end(), [](const Document& a, const Document& b) {
+        return a.sourcePath < b.sourcePath;
+    });
 
-        uint32_t num = static_cast<uint32_t>(entries_.size());
-        uint32_t dim = static_cast<uint32_t>(entries_[0].embedding.size());
+    std::vector<uint64_t> sig(docs.size());
+    std::vector<std::size_t> tokens(docs.size());
+    std::size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    std::size_t slice = (docs.size() + workers - 1) / workers;
+    std::vector<std::future<void>> jobs;
+    for (std::size_t lo = 0; lo < docs.size(); lo += slice) {
+        std::size_t hi = std::min(docs.size(), lo + slice);
+        jobs.push_back(std::async(std::launch::async, [&, lo, hi]() {
+            for (std::size_t i = lo; i < hi; ++i) sig[i] = simHash(docs[i].content, &tokens[i]);
+        }));
+    }
+    for (auto& j : jobs) j.get();
 
-        out.write(reinterpret_cast<const char*>(&num), sizeof(num));
-        out.write(reinterpret_cast<const char*>(&dim), sizeof(dim));
+    int bands = std::min(maxDistance + 1, 64);
+    auto bandKey = [&](uint64_t s, int b) {
+        int lo = b * 64 / bands, hi = (b + 1) * 64 / bands;
+        uint64_t mask = hi - lo == 64 ? ~uint64_t{0} : ((uint64_t{1} << (hi - lo)) - 1);
+        return (static_cast<uint64_t>(b) << 58) ^ ((s >> lo) & mask);
+    };
 
-        for (const auto& e : entries_) {
-            out.write(reinterpret_cast<const char*>(e.embedding.data()),
-                        static_cast<std::streamsize>(dim * sizeof(float)));
+    std::unordered_map<uint64_t, std::vector<std::size_t>> buckets;
+    std::unordered_map<std::string, std::size_t> exact;
+    std::vector<Document> kept;
+    std::vector<uint64_t> keptSig;
+    std::size_t dropped = 0;
+    for (std::size_t i = 0; i < docs.size(); ++i) {
+        std::size_t match = kept.size();
+        bool fuzzy = tokens[i] > 0 && tokens[i] >= minTokens;
+        if (!fuzzy) {
+            auto it = exact.find(docs[i].content);
+            if (it != exact.end()) match = it->second;
+        } else {
+            for (int b = 0; b < bands && match == kept.size(); ++b) {
+                auto it = buckets.find(bandKey(sig[i], b));
+                if (it == buckets.end()) continue;
+                for (std::size_t k : it->second) {
+                    if (std::bitset<64>(keptSig[k] ^ sig[i]).count() <= static_cast<std::size_t>(maxDistance)) {
+                        match = k;
+                        break;
+                    }
+                }
+            }
         }
-
-        // Save metadata as JSON
-        json j = json::array();
-        for (const auto& e : entries_) {
-            j.push_back({
-                {"id",      e.doc.id},
-                {"source",  e.doc.sourcePath},
-                {"content", e.doc.content}
-            });
+        if (match != kept.size()) {
+            Document& into = kept[match];
+            const std::string& src = docs[i].sourcePath;
+            if (src != into.sourcePath &&
+                std::find(into.aliasSources.begin(), into.aliasSources.end(), src) == into.aliasSources.end()) {
+                into.aliasSources.push_back(src);
+            }
+            ++dropped;
+            continue;
         }
-        writeStringToFile(cfg_.metaPath, j.dump(2));
+        if (fuzzy) {
+            for (int b = 0; b < bands; ++b) buckets[bandKey(sig[i], b)].push_back(kept.size());
+        } else {
+            exact.emplace(docs[i].content, kept.size());
+        }
+        keptSig.push_back(sig[i]);
+        kept.push_back(std::move(docs[i]));
     }
+    docs = std::move(kept);
+    return dropped;
+}
 
-    void loadFromDisk() {
-        entries_.clear();
+// ---------------------- Metrics (Prometheus text format) ----------------------
 
-        std::ifstream in(cfg_.indexPath, std::ios::binary);
-        if (!in) {
-            throw std::runtime_error("Failed to open index file");
-        }
+// Cumulative histogram over fixed bucket bounds (seconds). observe() is two
+// relaxed atomic adds, so any thread can record without taking a lock.
+class LatencyHistogram {
+public:
+    static constexpr double kBounds[] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+                                         0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60,
+                                         120, 300};
+    static constexpr std::size_t kBuckets = sizeof(kBounds) / sizeof(kBounds[0]);
 
-        uint32_t num = 0;
-        uint32_t dim = 0;
-        in.read(reinterpret_cast<char*>(&num), sizeof(num));
-        in.read(reinterpret_cast<char*>(&dim), sizeof(dim));
+    void observe(double seconds) {
+        std::size_t b = std::lower_bound(kBounds, kBounds + kBuckets, seconds) - kBounds;
+        counts_[b].fetch_add(1, std::memory_order_relaxed);
+        sumNs_.fetch_add(static_cast<uint64_t>(std::max(seconds, 0.0) * 1e9),
+                         std::memory_order_relaxed);
+    }
 
-        std::string metaStr = readFileToString(cfg_.metaPath);
-        json j = json::parse(metaStr);
+    // per-bucket (not cumulative) counts; the last one is +Inf
+    uint64_t bucket(std::size_t b) const { return counts_[b].load(std::memory_order_relaxed); }
+    double sumSeconds() const { return sumNs_.load(std::memory_order_relaxed) / 1e9; }
 
-        if (j.size() != num) {
-            throw std::runtime_error("Metadata size does not match index");
-        }
+private:
+    std::atomic<uint64_t> counts_[kBuckets + 1] = {};
+    std::atomic<uint64_t> sumNs_{0};
+};
 
-        entries_.resize(num);
-        for (uint32_t i = 0; i < num; ++i) {
-            Document d;
-            d.id         = j[i]["id"].get<std::string>();
-            d.sourcePath = j[i]["source"].get<std::string>();
-            d.content    = j[i]["content"].get<std::string>();
+// Per-stage latency histograms and query outcome counters for one engine.
+// A CLI process answers a handful of queries, so flush() adds its numbers
+// to the totals in a shared file that every sentra process updates in turn.
+class EngineMetrics {
+public:
+    enum Stage { Embed, Semantic, Keyword, Retrieve, Context, Chat, Total,
+                 IndexLoad, IndexSync, kStageCount };
+    enum Outcome { Answered, OffTopic, Failed, kOutcomeCount };
 
-            std::vector<float> emb(dim);
-            in.read(reinterpret_cast<char*>(emb.data()),
-                    static_cast<std::streamsize>(dim * sizeof(float)));
+    void observeMs(Stage stage, double ms) { stages_[stage].observe(ms / 1000.0); }
+    void count(Outcome outcome) { outcomes_[outcome].fetch_add(1, std::memory_order_relaxed); }
 
-            entries_[i].doc = std::move(d);
-            entries_[i].embedding = std::move(emb);
-        }
+    // Token usage of one API call. `stage` is "embed" (questions), "chat"
+    // or "index_embed" (ingestion); models are not known up front, so these
+    // counters sit in a small map under a mutex, taken once per API call.
+    void addTokens(const std::string& stage, const TokenUsage& usage, double costUsd) {
+        std::lock_guard<std::mutex> lock(tokensMu_);
+        TokenTotals& t = tokens_[{stage, usage.model}];
+        t.prompt += usage.promptTokens;
+        t.completion += usage.completionTokens;
+        t.cached += usage.cachedTokens;
+        t.costUsd += costUsd;
     }
 
-    std::vector<Document> search(const std::vector<float>& queryEmbedding,
-                                 int topK) const {
-        if (entries_.empty()) {
-            throw std::runtime_error("Index is empty.");
-        }
+    // Samples as "name{labels}" -> value, plus `base` (a previous render).
+    std::string render(const std::map<std::string, double>& base = {}) const {
+        static const char* const stageNames[] = {"embed", "semantic", "keyword", "retrieve",
+                                                 "context", "chat", "total", "index_load",
+                                                 "index_sync"};
+        static const char* const outcomeNames[] = {"answered", "off_topic", "failed"};
+        std::ostringstream out;
+        out.precision(12);
+        auto sample = [&](const std::string& key, double value) {
+            auto it = base.find(key);
+            out << key << ' ' << value + (it == base.end() ? 0.0 : it->second) << '\n';
+        };
 
-        std::vector<std::pair<float, size_t>> scored;
-        scored.reserve(entries_.size());
-        for (size_t i = 0; i < entries_.size(); ++i) {
-            float s = cosineSim(queryEmbedding, entries_[i].embedding);
-            scored.emplace_back(s, i);
+        out << "# HELP sentra_engine_stage_seconds Time spent in each engine stage.\n"
+            << "# TYPE sentra_engine_stage_seconds histogram\n";
+        for (int s = 0; s < kStageCount; ++s) {
+            const auto& h = stages_[s];
+            std::string label = std::string("stage=\"") + stageNames[s] + "\"";
+            uint64_t cumulative = 0;
+            for (std::size_t b = 0; b <= LatencyHistogram::kBuckets; ++b) {
+                cumulative += h.bucket(b);
+                std::ostringstream le;
+                if (b < LatencyHistogram::kBuckets) le << LatencyHistogram::kBounds[b];
+                else le << "+Inf";
+                sample("sentra_engine_stage_seconds_bucket{" + label + ",le=\"" + le.str() + "\"}",
+                       static_cast<double>(cumulative));
+            }
+            sample("sentra_engine_stage_seconds_sum{" + label + "}", h.sumSeconds());
+            sample("sentra_engine_stage_seconds_count{" + label + "}", static_cast<double>(cumulative));
         }
 
-        if (topK > static_cast<int>(scored.size())) {
-            topK = static_cast<int>(scored.size());
+        out << "# HELP sentra_engine_queries_total Queries answered by the engine, by outcome.\n"
+            << "# TYPE sentra_engine_queries_total counter\n";
+        for (int o = 0; o < kOutcomeCount; ++o) {
+            sample(std::string("sentra_engine_queries_total{outcome=\"") + outcomeNames[o] + "\"}",
+                   static_cast<double>(outcomes_[o].load(std::memory_order_relaxed)));
         }
 
-        std::partial_sort(
-            scored.begin(),
-            scored.begin() + topK,
-            scored.end(),
-            [](const auto& a, const auto& b) {
-                return a.first > b.first; // descending
+        // series for models only earlier runs used are carried over from base
+        std::map<std::string, double> tokens, cost;
+        for (const auto& [key, value] : base) {
+            if (key.rfind("sentra_engine_tokens_total{", 0) == 0) tokens[key] = 0.0;
+            if (key.rfind("sentra_engine_cost_usd_total{", 0) == 0) cost[key] = 0.0;
+        }
+        {
+            std::lock_guard<std::mutex> lock(tokensMu_);
+            for (const auto& [labels, t] : tokens_) {
+                std::string l = "stage=\"" + labels.first + "\",model=\"" + labels.second + "\"";
+                tokens["sentra_engine_tokens_total{" + l + ",kind=\"prompt\"}"] += t.prompt;
+                tokens["sentra_engine_tokens_total{" + l + ",kind=\"completion\"}"] += t.completion;
+                tokens["sentra_engine_tokens_total{" + l + ",kind=\"cached\"}"] += t.cached;
+                cost["sentra_engine_cost_usd_total{" + l + "}"] += t.costUsd;
             }
-        );
-
-        std::vector<Document> result;
-        result.reserve(topK);
-        for (int i = 0; i < topK; ++i) {
-            size_t idx = scored[i].second;
-            result.push_back(entries_[idx].doc);
         }
-        return result;
+        out << "# HELP sentra_engine_tokens_total API tokens used, by stage, model and kind.\n"
+            << "# TYPE sentra_engine_tokens_total counter\n";
+        for (const auto& [key, value] : tokens) sample(key, value);
+        out << "# HELP sentra_engine_cost_usd_total Estimated API cost in USD, by stage and model.\n"
+            << "# TYPE sentra_engine_cost_usd_total counter\n";
+        for (const auto& [key, value] : cost) sample(key, value);
+        return out.str();
     }
 
-private:
-    SentraConfig cfg_;
-    std::vector<IndexEntry> entries_;
-
-    static float cosineSim(const std::vector<float>& a,
-                           const std::vector<float>& b) {
-        if (a.size() != b.size() || a.empty()) {
-            return 0.0f;
-        }
-        double dot = 0.0;
-        double na = 0.0;
-        double nb = 0.0;
-        for (size_t i = 0; i < a.size(); ++i) {
-            dot += static_cast<double>(a[i]) * static_cast<double>(b[i]);
-            na  += static_cast<double>(a[i]) * static_cast<double>(a[i]);
-            nb  += static_cast<double>(b[i]) * static_cast<double>(b[i]);
+    // Add this process's metrics to the totals in `path`. Callers flush
+    // once, at exit: a second flush would count the same samples again.
+    void flush(const std::string& path) const {
+        if (path.empty()) return;
+        IndexWriterLock lock(path + ".lock");
+        if (!lock.tryLock(true)) {
+            std::cerr << "[WARN] Could not lock " << path << "; metrics not saved\n";
+            return;
         }
-        if (na == 0.0 || nb == 0.0) {
-            return 0.0f;
+        std::map<std::string, double> base;
+        if (fs::exists(path)) {
+            std::istringstream in(readFileToString(path));
+            std::string line;
+            while (std::getline(in, line)) {
+                auto space = line.rfind(' ');
+                if (line.empty() || line[0] == '#' || space == std::string::npos) continue;
+                try {
+                    base[line.substr(0, space)] = std::stod(line.substr(space + 1));
+                } catch (const std::exception&) {
+                    // not one of ours; dropped on rewrite
+                }
+            }
         }
-        return static_cast<float>(dot / (std::sqrt(na) * std::sqrt(nb)));
+        std::string tmp = path + ".tmp";
+        writeStringToFile(tmp, render(base));
+        fs::rename(tmp, path);
     }
+
+private:
+    struct TokenTotals {
+        uint64_t prompt = 0, completion = 0, cached = 0;
+        double costUsd = 0.0;
+    };
+
+    LatencyHistogram stages_[kStageCount];
+    std::atomic<uint64_t> outcomes_[kOutcomeCount] = {};
+    mutable std::mutex tokensMu_;
+    std::map<std::pair<std::string, std::string>, TokenTotals> tokens_;   // (stage, model)
 };
 
 // ---------------------- Engine (orchestration) ----------------------
@@ -391,8 +3912,9 @@ std::vector<Document> loadDocuments(const std::string& dataDir) {
         throw std::runtime_error("Data directory does not exist: " + dataDir);
     }
 
+    // subfolders are walked too, so data/<customer>/... can be filtered on
     int docCounter = 0;
-    for (const auto& entry : fs::directory_iterator(dirPath)) {
+    for (const auto& entry : fs::recursive_directory_iterator(dirPath)) {
         if (!entry.is_regular_file()) continue;
         auto path = entry.path();
         if (path.extension() != ".txt") continue;
@@ -422,89 +3944,602 @@ std::vector<Document> loadDocuments(const std::string& dataDir) {
     return docs;
 }
 
+// Wall-clock time spent in each stage of one SentraEngine::answer call, in
+// milliseconds. The semantic and keyword searches run concurrently inside
+// retrieve, so they overlap; a retriever that missed its deadline reports 0.
+struct AnswerStats {
+    double embedMs    = 0.0;   // embeddings API call for the question
+    double semanticMs = 0.0;   // vector search
+    double keywordMs  = 0.0;   // BM25 search
+    double retrieveMs = 0.0;   // both retrievers plus fusion
+    double contextMs  = 0.0;
+    double chatMs     = 0.0;
+    double totalMs    = 0.0;
+    bool offTopic     = false;   // no relevant chunk; chat skipped or context-free
+
+    // tokens reported by the API for the question's embedding and the chat
+    // call (empty if it was not made), and their estimated cost
+    TokenUsage embedUsage;
+    TokenUsage chatUsage;
+    double costUsd = 0.0;
+
+    // heap allocations per stage, indexed by EngineMetrics::Stage (embed to
+    // total); counted across the retriever threads, and only in builds with
+    // -DSENTRA_ALLOC_PROFILE
+    AllocCount allocs[EngineMetrics::kStageCount];
+};
+
+// Trim retrieved chunks to the prompt budget and tag each with its source.
+// Reads the chunks in place in the index; the entries are allocated from
+// `mr`, one allocation each.
+ContextChunks buildContext(const std::vector<Candidate>& hits,
+                           std::pmr::memory_resource* mr = std::pmr::get_default_resource()) {
+    ContextChunks context(mr);
+    context.reserve(hits.size());
+
+    const std::size_t MAX_TOTAL_CHARS = 3000;   // overall cap ~750 tokens
+    const std::size_t MAX_CHARS_PER_CHUNK = 800;
+    const std::string_view ELLIPSIS = "...";
+    std::size_t total_chars = 0;
+
+    for (const auto& hit : hits) {
+        if (total_chars >= MAX_TOTAL_CHARS) break;
+
+        std::string_view chunk = hit.content();
+        bool truncated = false;
+
+        // per-chunk cap
+        if (chunk.size() > MAX_CHARS_PER_CHUNK) {
+            chunk = chunk.substr(0, MAX_CHARS_PER_CHUNK);
+            truncated = true;
+        }
+
+        // would this push us over the global cap?
+        std::size_t length = chunk.size() + (truncated ? ELLIPSIS.size() : 0);
+        if (total_chars + length > MAX_TOTAL_CHARS) {
+            std::size_t remaining = MAX_TOTAL_CHARS - total_chars;
+            if (remaining > 0 && remaining < length) {
+                chunk = chunk.substr(0, remaining);
+                truncated = true;
+            } else if (remaining == 0) {
+                break;
+            }
+        }
+
+        std::string_view source = hit.sourcePath();
+        std::pmr::string& decorated = context.emplace_back();
+        decorated.reserve(source.size() + 3 + chunk.size() + ELLIPSIS.size());
+        decorated.append("[").append(source).append("]\n").append(chunk);
+        if (truncated) decorated.append(ELLIPSIS);
+        total_chars += decorated.size();
+    }
+
+    // Debug: see how big our context really is
+    if (DEBUG_CHAT) {
+        std::cerr << "Using " << context.size()
+                    << " chunks, total_chars=" << total_chars << "\n";
+    }
+
+    return context;
+}
+
 class SentraEngine {
 public:
-    SentraEngine(const SentraConfig& cfg, LlmClient& llm, VectorIndex& index)
-        : cfg_(cfg), llm_(llm), index_(index) {}
+    SentraEngine(const SentraConfig& cfg, LlmClient& llm, std::shared_ptr<VectorIndex> index)
+        : cfg_(cfg), llm_(llm), index_(std::move(index)), writerLock_(cfg.lockPath) {}
+
+    ~SentraEngine() {
+        for (auto& f : stragglers_) f.wait();
+        std::future<void> pending = std::move(reload_);
+        if (pending.valid()) pending.wait();
+    }
 
-    void buildOrLoadIndex() {
-        if (index_.existsOnDisk()) {
-            index_.loadFromDisk();
+    // Load the index for answering queries, or with `sync` (--sync, used by
+    // the frontend's /api/ingest) bring it up to date with data/ first.
+    // Only a sync takes the writer lock and reads data/: a query process
+    // loads the last checkpoint read-only and picks up new ones via
+    // reloadIfChanged(), so a changed data/ never delays a query. The
+    // exception is a fresh install with no index at all, which is built in
+    // the foreground before the first query is answered.
+    void buildOrLoadIndex(bool sync = false) {
+        fs::create_directories(cfg_.artifactsDir);
+        auto index = currentIndex();
+
+        if (!sync && index->existsOnDisk()) {
+            index->setWritable(false);
+            loadIndex(*index);
             return;
         }
 
-        auto docs = loadDocuments(cfg_.dataDir);
-        if (docs.empty()) {
-            throw std::runtime_error("No documents found in data directory.");
+        // a sync waits its turn; a first build gives up if one is running
+        if (!writerLock_.tryLock(sync)) {
+            throw std::runtime_error("Index is being built by another process; try again shortly.");
         }
-
-        std::vector<std::vector<float>> embeddings;
-        embeddings.reserve(docs.size());
-        for (const auto& d : docs) {
-            embeddings.push_back(llm_.embed(d.content));
+        index->setWritable(true);
+        if (index->existsOnDisk()) {
+            loadIndex(*index);
+        }
+        if (sync || index->liveCount() == 0) {
+            // Every chunk goes through the WAL and the index is
+            // checkpointed as it grows, so an interrupted build resumes
+            // from where it stopped instead of starting over.
+            syncWithDataDir();
+            if (index->liveCount() == 0) {
+                throw std::runtime_error("No documents found in data directory.");
+            }
+        }
+        if (!sync) {
+            // built (or finished by someone else meanwhile); serve it
+            // read-only and leave later syncs to --sync
+            index->setWritable(false);
+            auto state = diskState();
+            writerLock_.unlock();
+            rememberDiskState(state);
         }
+    }
 
-        index_.build(docs, std::move(embeddings));
-        index_.saveToDisk();
+    // Load a fresh copy of the index from disk and publish it with an atomic
+    // swap. Searches already running keep the old instance alive through
+    // their shared_ptr and finish on it; new ones see the new index.
+    void reloadIndex() {
+        auto next = std::make_shared<VectorIndex>(cfg_);
+        next->setWritable(writerLock_.held());
+        auto state = diskState();
+        auto t0 = std::chrono::steady_clock::now();
+        next->loadFromDisk();
+        metrics_.observeMs(EngineMetrics::IndexLoad, msSince(t0));
+        std::atomic_store(&index_, std::move(next));
+        rememberDiskState(state);
     }
 
-    std::string answer(const std::string& question) {
-        // 1) Embed the question
-        auto qEmb = llm_.embed(question);
+    // Cheap check (two stats) for a checkpoint or WAL written by another
+    // process. When something changed, the reload runs in the background
+    // and the current query is answered from the index already loaded.
+    void reloadIfChanged() {
+        if (writerLock_.held()) return;   // we are the one writing
+        // concurrent queries: one checks, the others go ahead
+        std::unique_lock<std::mutex> lock(reloadMu_, std::try_to_lock);
+        if (!lock.owns_lock()) return;
+        if (reload_.valid() &&
+            reload_.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            return;
+        }
+        if (!diskChanged()) return;
+
+        reload_ = std::async(std::launch::async, [this]() {
+            try {
+                reloadIndex();
+            } catch (const std::exception& ex) {
+                // most likely caught the writer between two files; retry next query
+                std::cerr << "[WARN] Index reload failed: " << ex.what() << "\n";
+            }
+        });
+    }
 
-        // 2) Retrieve top-k docs
-        auto docs = index_.search(qEmb, cfg_.topK);
+    std::shared_ptr<VectorIndex> currentIndex() const {
+        return std::atomic_load(&index_);
+    }
 
-        // 3) Build *bounded* context
-        std::vector<std::string> context;
-        context.reserve(docs.size());
+    // Bring the index in line with the data directory: chunks from removed
+    // or changed files are tombstoned, changed and new files are added.
+    // Chunks whose text is already indexed under the same source reuse the
+    // stored embedding, so after an interrupted build only the chunks that
+    // are still missing are sent to the embeddings API. Near-duplicate
+    // chunks are collapsed first; a source whose chunks were all aliased
+    // to other entries counts as present.
+    void syncWithDataDir() {
+        auto start = std::chrono::steady_clock::now();
+        TraceSpan span("index_sync", "index");
+        auto loaded = loadDocuments(cfg_.dataDir);
+        std::size_t collapsed = collapseNearDuplicates(loaded, cfg_.nearDuplicateDistance,
+                                                       cfg_.nearDuplicateMinTokens);
+        if (collapsed > 0) {
+            std::cerr << "Collapsed " << collapsed << " near-duplicate chunks.\n";
+        }
 
-        const std::size_t MAX_TOTAL_CHARS = 3000;   // overall cap ~750 tokens
-        const std::size_t MAX_CHARS_PER_CHUNK = 800;
-        std::size_t total_chars = 0;
+        std::map<std::string, std::vector<Document>> fresh;
+        std::size_t totalChunks = 0;
+        for (auto& d : loaded) {
+            fresh[d.sourcePath].push_back(std::move(d));
+            ++totalChunks;
+        }
+        auto index = currentIndex();
+        auto indexed = index->documentsBySource();
 
-        for (const auto& d : docs) {
-            if (total_chars >= MAX_TOTAL_CHARS) break;
+        // an entry whose aliases changed is re-added (with its stored
+        // embedding) so the filter bitmaps see the new alias list
+        auto unchanged = [](const std::vector<Document>& have,
+                            const std::vector<Document>& want) {
+            if (have.size() != want.size()) return false;
+            for (size_t i = 0; i < have.size(); ++i) {
+                if (have[i].content != want[i].content ||
+                    have[i].aliasSources != want[i].aliasSources) {
+                    return false;
+                }
+            }
+            return true;
+        };
 
-            std::string chunk = d.content;
+        // embeddings of removed entries stay reusable by chunk text from any
+        // source, since a surviving alias may now be the one that is kept
+        std::size_t removed = 0;
+        std::map<std::string, std::vector<float>> known;
+        for (const auto& [source, contents] : indexed) {
+            auto it = fresh.find(source);
+            if (it == fresh.end() || !unchanged(contents, it->second)) {
+                known.merge(index->embeddingsForSource(source));
+                removed += index->removeSource(source);
+            }
+        }
 
-            // per-chunk cap
-            if (chunk.size() > MAX_CHARS_PER_CHUNK) {
-                chunk = chunk.substr(0, MAX_CHARS_PER_CHUNK);
-                chunk += "...";
+        std::size_t added = 0, embedded = 0, done = 0;
+        for (auto& [source, chunks] : fresh) {
+            auto it = indexed.find(source);
+            if (it != indexed.end() && unchanged(it->second, chunks)) {
+                done += chunks.size();
+                continue;
             }
+            for (auto& d : chunks) {
+                // each distinct text is embedded once: identical chunks
+                // elsewhere in the index (or added earlier in this sync)
+                // share the stored vector
+                std::vector<float> emb;
+                auto hit = known.find(d.content);
+                if (hit != known.end()) {
+                    emb = hit->second;
+                } else if (emb = index->embeddingForContent(d.content); emb.empty()) {
+                    TokenUsage usage;
+                    emb = llm_.embed(d.content, &usage);
+                    chargeTokens("index_embed", usage);
+                    ++embedded;
+                }
+                d.id = index->allocateId();
+                if (index->append(d, std::move(emb))) ++added;
+                ++done;
 
-            // would this push us over the global cap?
-            if (total_chars + chunk.size() > MAX_TOTAL_CHARS) {
-                std::size_t remaining = MAX_TOTAL_CHARS - total_chars;
-                if (remaining > 0 && remaining < chunk.size()) {
-                    chunk = chunk.substr(0, remaining);
-                    chunk += "...";
-                } else if (remaining == 0) {
-                    break;
+                if (index->checkpointDue()) {
+                    index->saveToDisk();
+                    std::cerr << "Indexed " << done << "/" << totalChunks
+                              << " chunks (checkpoint written).\n";
                 }
             }
+        }
 
-            std::string decorated = "[" + d.sourcePath + "]\n" + chunk;
-            total_chars += decorated.size();
-            context.push_back(std::move(decorated));
+        if (removed == 0 && added == 0) {
+            metrics_.observeMs(EngineMetrics::IndexSync, msSince(start));
+            return;
+        }
+        if (index->liveCount() == 0) {
+            throw std::runtime_error("No documents found in data directory.");
         }
 
-        // Debug: see how big our context really is
-        if (DEBUG_CHAT) {
-            std::cerr << "Using " << context.size()
-                        << " chunks, total_chars=" << total_chars << "\n";
+        std::cerr << "Index sync: removed " << removed << " chunks, added "
+                  << added << " chunks (" << embedded << " newly embedded).\n";
+        index->seal();
+        index->saveToDisk();
+        metrics_.observeMs(EngineMetrics::IndexSync, msSince(start));
+    }
+
+    // Run every retriever concurrently and fuse the lists that arrive in
+    // time, so the slowest retriever doesn't add to the others' latency.
+    // The hits point into the index snapshot they were found in.
+    std::vector<Candidate> retrieve(const std::string& question,
+                                    const SearchFilter& filter = {},
+                                    AnswerStats* stats = nullptr) {
+        TraceSpan span("retrieve");
+        uint64_t query = Tracer::currentQuery();
+        auto index = currentIndex();
+        // retrievers that miss their deadline finish later, so their
+        // timings live outside this call's frame
+        struct Timings {
+            std::atomic<double> embedMs{0.0}, semanticMs{0.0}, keywordMs{0.0};
+            std::mutex usageMu;
+            TokenUsage embedUsage;   // guarded by usageMu
+            AllocCount embedAllocs, semanticAllocs, keywordAllocs;   // guarded by usageMu
+        };
+        auto timings = std::make_shared<Timings>();
+        auto since = [](std::chrono::steady_clock::time_point t0) {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        };
+        std::vector<Retriever> retrievers = {
+            {"semantic", cfg_.semanticWeight, std::chrono::milliseconds(cfg_.semanticDeadlineMs),
+             [this, index, question, filter, timings, since, query](int k) {
+                 TraceQueryScope scope(query);
+                 auto t0 = std::chrono::steady_clock::now();
+                 TokenUsage usage;
+                 std::vector<float> emb;
+                 AllocScope embedAllocs;
+                 {
+                     TraceSpan span("embed");
+                     emb = llm_.embed(question, &usage);
+                 }
+                 timings->embedMs = since(t0);
+                 chargeTokens("embed", usage);
+                 AllocCount embedCount = embedAllocs.delta();
+                 auto t1 = std::chrono::steady_clock::now();
+                 AllocScope searchAllocs;
+                 std::vector<Candidate> hits;
+                 {
+                     TraceSpan span("semantic_search", "search");
+                     hits = index->searchRange(emb, cfg_.relevanceThreshold, k, filter);
+                 }
+                 timings->semanticMs = since(t1);
+                 std::lock_guard<std::mutex> lock(timings->usageMu);
+                 timings->embedUsage = std::move(usage);
+                 timings->embedAllocs = embedCount;
+                 timings->semanticAllocs = searchAllocs.delta();
+                 return hits;
+             },
+             true},
+            {"keyword", cfg_.keywordWeight, std::chrono::milliseconds(cfg_.keywordDeadlineMs),
+             [index, question, filter, timings, since, query](int k) {
+                 TraceQueryScope scope(query);
+                 TraceSpan span("keyword_search", "search");
+                 AllocScope allocs;
+                 auto t0 = std::chrono::steady_clock::now();
+                 auto hits = index->searchLexical(question, k, filter);
+                 {
+                     std::lock_guard<std::mutex> lock(timings->usageMu);
+                     timings->keywordAllocs = allocs.delta();
+                 }
+                 timings->keywordMs = since(t0);
+                 return hits;
+             },
+             // below --min-score semantically, but naming the part number
+             // (or model, version) the question asks about
+             true, [question](const std::vector<Candidate>& hits) {
+                 return hasExactIdentifierHit(question, hits);
+             }},
+        };
+        auto t0 = std::chrono::steady_clock::now();
+        AllocScope allocs;
+        auto hits = fuse(retrievers);
+        if (stats) {
+            stats->retrieveMs = since(t0);
+            stats->embedMs    = timings->embedMs;
+            stats->semanticMs = timings->semanticMs;
+            stats->keywordMs  = timings->keywordMs;
+            std::lock_guard<std::mutex> lock(timings->usageMu);
+            stats->embedUsage = timings->embedUsage;
+            stats->allocs[EngineMetrics::Embed]    = timings->embedAllocs;
+            stats->allocs[EngineMetrics::Semantic] = timings->semanticAllocs;
+            stats->allocs[EngineMetrics::Keyword]  = timings->keywordAllocs;
+            AllocCount& retrieve = stats->allocs[EngineMetrics::Retrieve];
+            retrieve = allocs.delta();
+            retrieve += timings->embedAllocs;
+            retrieve += timings->semanticAllocs;
+            retrieve += timings->keywordAllocs;
+        }
+        return hits;
+    }
+
+    std::vector<Candidate> fuse(const std::vector<Retriever>& retrievers) {
+        auto start = std::chrono::steady_clock::now();
+        bool diversify = cfg_.mmrLambda < 1.0f;
+        int keep = diversify ? std::max(cfg_.mmrPoolK, cfg_.topK) : cfg_.topK;
+        int pool = std::max(cfg_.fusionPoolK, keep);
+
+        std::vector<std::future<std::vector<Candidate>>> jobs;
+        for (const auto& r : retrievers) {
+            jobs.push_back(std::async(std::launch::async, r.retrieve, pool));
+        }
+
+        // a gate that missed its deadline or failed cannot rule the query
+        // off-topic; the others' lists are used as they are
+        std::size_t gatesLeft = std::count_if(retrievers.begin(), retrievers.end(),
+                                              [](const Retriever& r) { return r.gate; });
+        bool anyGate = gatesLeft > 0, vouched = false, gateUnknown = false;
+
+        std::vector<std::pair<float, std::vector<Candidate>>> lists;
+        std::exception_ptr firstError;
+        for (size_t i = 0; i < retrievers.size(); ++i) {
+            const Retriever& r = retrievers[i];
+            if (r.gate) --gatesLeft;
+            if (jobs[i].wait_until(start + r.deadline) != std::future_status::ready) {
+                std::cerr << "[WARN] Retriever '" << r.name << "' missed its "
+                          << r.deadline.count() << " ms deadline.\n";
+                park(std::move(jobs[i]));
+                gateUnknown = gateUnknown || r.gate;
+                continue;
+            }
+            try {
+                lists.emplace_back(r.weight, jobs[i].get());
+                const auto& list = lists.back().second;
+                if (r.gate) vouched = vouched || (r.vouches ? r.vouches(list) : !list.empty());
+            } catch (const std::exception& ex) {
+                std::cerr << "[WARN] Retriever '" << r.name << "' failed: "
+                          << ex.what() << "\n";
+                if (!firstError) firstError = std::current_exception();
+                gateUnknown = gateUnknown || r.gate;
+            }
+            if (anyGate && gatesLeft == 0 && !vouched && !gateUnknown) {
+                // off-topic: don't wait for the others (a std::async
+                // future blocks in its destructor)
+                for (size_t j = i + 1; j < jobs.size(); ++j) park(std::move(jobs[j]));
+                return {};
+            }
+        }
+
+        if (lists.empty()) {
+            if (firstError) std::rethrow_exception(firstError);
+            throw std::runtime_error("No retriever finished before its deadline.");
         }
+        auto fused = fuseCandidates(lists, parseFusionMode(cfg_.fusionMode), keep);
+        if (!diversify) return fused;
+        return diversifyMmr(std::move(fused), cfg_.topK, cfg_.mmrLambda);
+    }
 
-        // 4) Ask LLM with trimmed context
-        return llm_.chatWithContext(question, context);
+    // Safe to call from several threads at once. Pass `stats` to get the
+    // time spent in each stage; every call is also recorded in metrics().
+    std::string answer(const std::string& question, const SearchFilter& filter = {},
+                       AnswerStats* stats = nullptr) {
+        AnswerStats local;
+        if (!stats) stats = &local;
+        static std::atomic<uint64_t> queryCounter{0};
+        TraceQueryScope scope(++queryCounter);
+        TraceSpan span("answer", "query", question);
+        std::string reply;
+        AllocScope allocs;
+        try {
+            reply = answerStages(question, filter, stats);
+        } catch (...) {
+            metrics_.count(EngineMetrics::Failed);
+            throw;
+        }
+        // this thread, plus the retrievers' threads
+        AllocCount& total = stats->allocs[EngineMetrics::Total];
+        total = allocs.delta();
+        for (auto stage : {EngineMetrics::Embed, EngineMetrics::Semantic, EngineMetrics::Keyword}) {
+            total += stats->allocs[stage];
+        }
+        // a stage reported as 0 ms did not run (off-topic, missed deadline)
+        auto observe = [this](EngineMetrics::Stage stage, double ms) {
+            if (ms > 0.0) metrics_.observeMs(stage, ms);
+        };
+        observe(EngineMetrics::Embed, stats->embedMs);
+        observe(EngineMetrics::Semantic, stats->semanticMs);
+        observe(EngineMetrics::Keyword, stats->keywordMs);
+        observe(EngineMetrics::Retrieve, stats->retrieveMs);
+        observe(EngineMetrics::Context, stats->contextMs);
+        observe(EngineMetrics::Chat, stats->chatMs);
+        observe(EngineMetrics::Total, stats->totalMs);
+        metrics_.count(stats->offTopic ? EngineMetrics::OffTopic : EngineMetrics::Answered);
+        return reply;
     }
 
+    const EngineMetrics& metrics() const { return metrics_; }
 
 private:
     SentraConfig cfg_;
     LlmClient& llm_;
-    VectorIndex& index_;
+    std::shared_ptr<VectorIndex> index_;   // read via currentIndex(), swapped by reloadIndex()
+    IndexWriterLock writerLock_;
+    std::future<void> reload_;         // guarded by reloadMu_
+    std::mutex reloadMu_;
+    EngineMetrics metrics_;
+
+    static double msSince(std::chrono::steady_clock::time_point t0) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    }
+
+    double costOf(const std::string& stage, const TokenUsage& usage) const {
+        if (stage == "chat") {
+            return usage.costUsd(cfg_.chatPromptCostPer1K, cfg_.chatCachedCostPer1K,
+                                 cfg_.chatCompletionCostPer1K);
+        }
+        return usage.costUsd(cfg_.embeddingCostPer1K, cfg_.embeddingCostPer1K, 0.0);
+    }
+
+    void chargeTokens(const std::string& stage, const TokenUsage& usage) {
+        metrics_.addTokens(stage, usage, costOf(stage, usage));
+    }
+
+    std::string answerStages(const std::string& question, const SearchFilter& filter,
+                             AnswerStats* stats) {
+        using Clock = std::chrono::steady_clock;
+        auto start = Clock::now();
+        QueryArena arena;   // this query's context, prompt, request and response
+
+        reloadIfChanged();
+
+        // 1) Retrieve: semantic + keyword, fused
+        auto hits = retrieve(question, filter, stats);
+        std::string reply;
+        if (hits.empty()) {
+            stats->offTopic = true;
+            if (cfg_.offTopicMode == "no-context") {
+                auto t0 = Clock::now();
+                AllocScope allocs;
+                TraceSpan span("chat");
+                reply = llm_.chatWithoutContext(question, &stats->chatUsage, arena.resource());
+                stats->chatMs = msSince(t0);
+                stats->allocs[EngineMetrics::Chat] = allocs.delta();
+                chargeTokens("chat", stats->chatUsage);
+            } else {
+                reply = cfg_.offTopicAnswer;
+            }
+            stats->costUsd = costOf("embed", stats->embedUsage) + costOf("chat", stats->chatUsage);
+            stats->totalMs = msSince(start);
+            return reply;
+        }
+
+        // 2) Build *bounded* context
+        auto t0 = Clock::now();
+        ContextChunks context(arena.resource());
+        {
+            AllocScope allocs;
+            TraceSpan span("build_context");
+            context = buildContext(hits, arena.resource());
+            stats->allocs[EngineMetrics::Context] = allocs.delta();
+        }
+        stats->contextMs = msSince(t0);
+
+        // 3) Ask LLM with trimmed context
+        t0 = Clock::now();
+        {
+            AllocScope allocs;
+            TraceSpan span("chat");
+            reply = llm_.chatWithContext(question, context, &stats->chatUsage);
+            stats->allocs[EngineMetrics::Chat] = allocs.delta();
+        }
+        stats->chatMs = msSince(t0);
+        chargeTokens("chat", stats->chatUsage);
+        stats->costUsd = costOf("embed", stats->embedUsage) + costOf("chat", stats->chatUsage);
+        stats->totalMs = msSince(start);
+        return reply;
+    }
+
+    // retrievers that missed their deadline; they still reference this
+    // engine, so they are waited for before it is destroyed
+    std::mutex stragglersMu_;
+    std::vector<std::future<std::vector<Candidate>>> stragglers_;
+
+    void park(std::future<std::vector<Candidate>> job) {
+        std::lock_guard<std::mutex> lock(stragglersMu_);
+        stragglers_.erase(
+            std::remove_if(stragglers_.begin(), stragglers_.end(), [](const auto& f) {
+                return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+            }),
+            stragglers_.end());
+        stragglers_.push_back(std::move(job));
+    }
+
+    // (metadata.json mtime, WAL size) when the last load started
+    using DiskState = std::pair<fs::file_time_type, std::uintmax_t>;
+    DiskState diskState_;   // guarded by diskStateMu_
+    std::mutex diskStateMu_;
+
+    DiskState diskState() const {
+        std::error_code ec;
+        auto mtime = fs::last_write_time(cfg_.metaPath, ec);
+        if (ec) mtime = fs::file_time_type::min();
+        auto walSize = fs::file_size(cfg_.walPath, ec);
+        if (ec) walSize = 0;
+        return {mtime, walSize};
+    }
+
+    void loadIndex(VectorIndex& index) {
+        auto state = diskState();
+        auto t0 = std::chrono::steady_clock::now();
+        TraceSpan span("index_load", "index");
+        index.loadFromDisk();
+        metrics_.observeMs(EngineMetrics::IndexLoad, msSince(t0));
+        rememberDiskState(state);
+    }
+
+    // `state` is taken before the load it describes: a checkpoint or WAL
+    // record written while loading then still counts as a change, and the
+    // next query reloads.
+    void rememberDiskState(const DiskState& state) {
+        std::lock_guard<std::mutex> lock(diskStateMu_);
+        diskState_ = state;
+    }
+
+    bool diskChanged() {
+        auto state = diskState();
+        std::lock_guard<std::mutex> lock(diskStateMu_);
+        return state != diskState_;
+    }
 };
 
 // ---------------------- Config Loader ----------------------
@@ -522,21 +4557,91 @@ SentraConfig loadConfig() {
         throw std::runtime_error("api_key.txt is empty.");
     }
 
+    // e.g. the bundled stub server (bench/stub_llm_server.py) for offline runs
+    if (const char* url = std::getenv("SENTRA_BASE_URL"); url && *url) {
+        cfg.baseUrl = url;
+    }
+
     return cfg;
 }
 
 // ---------------------- main() ----------------------
 
-int main() {
+// The benchmarks in bench/ include this file with SENTRA_NO_MAIN defined.
+#ifndef SENTRA_NO_MAIN
+int main(int argc, char** argv) {
     try {
+        // --sync: bring the index up to date with data/, checkpoint and exit
+        // (used by the frontend's /api/ingest instead of deleting the index)
+        // --filter <path>: only answer from sources under data/<path>; may be
+        // given more than once
+        // --min-score <cosine>: below it a chunk is not relevant; questions
+        // with no relevant chunk get --off-topic refuse|no-context handling
+        // --record <file> / --replay <file>: save API responses to a
+        // cassette, or answer from one offline (--replay-latency none skips
+        // the recorded network time)
+        // --trace <file>: write a span for every stage of every query
+        // (Chrome trace-event JSON; open it in Perfetto or chrome://tracing)
+        bool syncOnly = false;
+        std::vector<std::string> filterPaths;
+        std::string minScore, offTopic, cassetteMode, cassettePath, replayLatency, tracePath;
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--sync") {
+                syncOnly = true;
+            } else if (arg == "--filter" && i + 1 < argc) {
+                filterPaths.push_back(argv[++i]);
+            } else if (arg == "--min-score" && i + 1 < argc) {
+                minScore = argv[++i];
+            } else if (arg == "--off-topic" && i + 1 < argc) {
+                offTopic = argv[++i];
+                if (offTopic != "refuse" && offTopic != "no-context") {
+                    throw std::runtime_error("Unknown --off-topic mode: " + offTopic);
+                }
+            } else if ((arg == "--record" || arg == "--replay") && i + 1 < argc) {
+                cassetteMode = arg.substr(2);
+                cassettePath = argv[++i];
+            } else if (arg == "--trace" && i + 1 < argc) {
+                tracePath = argv[++i];
+            } else if (arg == "--replay-latency" && i + 1 < argc) {
+                replayLatency = argv[++i];
+                if (replayLatency != "original" && replayLatency != "none") {
+                    throw std::runtime_error("Unknown --replay-latency: " + replayLatency);
+                }
+            } else {
+                throw std::runtime_error("Unknown argument: " + arg);
+            }
+        }
+
         SentraConfig cfg = loadConfig();
+        if (!minScore.empty()) cfg.relevanceThreshold = std::stof(minScore);
+        if (!offTopic.empty()) cfg.offTopicMode = offTopic;
+        if (!cassetteMode.empty()) {
+            cfg.httpCassetteMode = cassetteMode;
+            cfg.httpCassettePath = cassettePath;
+        }
+        if (!replayLatency.empty()) cfg.replayLatency = replayLatency;
+        // declared first so it outlives everything that records spans
+        std::unique_ptr<Tracer> tracer;
+        if (!tracePath.empty()) tracer = std::make_unique<Tracer>(tracePath);
         HttpClient http(cfg);
         LlmClient llm(cfg, http);
-        VectorIndex index(cfg);
+        auto index = std::make_shared<VectorIndex>(cfg);
         SentraEngine engine(cfg, llm, index);
 
+        SearchFilter filter;
+        for (const auto& p : filterPaths) {
+            filter.pathPrefixes.push_back((fs::path(cfg.dataDir) / p).string());
+        }
+
         std::cout << "Building / loading index...\n";
-        engine.buildOrLoadIndex();
+        engine.buildOrLoadIndex(syncOnly);
+        if (syncOnly) {
+            std::cout << "Index up to date: " << engine.currentIndex()->liveCount()
+                      << " chunks, " << engine.currentIndex()->vectorCount() << " vectors.\n";
+            engine.metrics().flush(cfg.metricsPath);
+            return 0;
+        }
         std::cout << "SentraAI CLI ready. Type 'exit' to quit.\n\n";
 
         std::string line;
@@ -546,8 +4651,19 @@ int main() {
             if (line == "exit" || line == "quit") break;
             if (line.empty()) continue;
 
+            if (line == "reload") {
+                try {
+                    engine.reloadIndex();
+                    std::cout << "Index reloaded: " << engine.currentIndex()->liveCount()
+                              << " chunks.\n\n";
+                } catch (const std::exception& ex) {
+                    std::cerr << "Error: " << ex.what() << "\n";
+                }
+                continue;
+            }
+
             try {
-                std::string ans = engine.answer(line);
+                std::string ans = engine.answer(line, filter);
                 for (char& c : ans) {
                     if (static_cast<unsigned char>(c) == 0x92 ||
                     static_cast<unsigned char>(c) == 0x27) {
@@ -560,6 +4676,7 @@ int main() {
             }
         }
 
+        engine.metrics().flush(cfg.metricsPath);
         std::cout << "Bye.\n";
         return 0;
     } catch (const std::exception& ex) {
@@ -567,3 +4684,4 @@ int main() {
         return 1;
     }
 }
+#endif  // SENTRA_NO_MAIN
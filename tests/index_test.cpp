@@ -0,0 +1,973 @@
+// Index lifecycle checks that need no network: each case runs in its own
+// scratch directory with empty artifacts, so nothing here touches data/ or
+// artifacts/ in the working tree.
+//
+//   g++ -std=c++17 -O2 -pthread tests/index_test.cpp -o index_test && ./index_test
+//
+// Exits non-zero and names the failed check if any case fails.
+
+#define SENTRA_NO_MAIN
+#include "../main.cpp"
+
+#include <iomanip>
+#include <set>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string& what) {
+    std::cout << (ok ? "ok   " : "FAIL ") << what << "\n";
+    if (!ok) ++failures;
+}
+
+// A config whose data/ and artifacts/ live under a fresh scratch directory.
+struct Scratch {
+    fs::path root;
+    SentraConfig cfg;
+
+    explicit Scratch(const std::string& name)
+        : root(fs::temp_directory_path() / ("sentra_test_" + name + "_" + std::to_string(::getpid()))) {
+        fs::remove_all(root);
+        fs::create_directories(root / "data");
+        std::string artifacts = (root / "artifacts").string();
+        cfg.apiKey       = "test";
+        cfg.baseUrl      = "http://127.0.0.1:9";   // nothing listens; no case may call the API
+        cfg.dataDir      = (root / "data").string();
+        cfg.artifactsDir = artifacts;
+        cfg.indexPath    = artifacts + "/index.bin";
+        cfg.metaPath     = artifacts + "/metadata.json";
+        cfg.walPath      = artifacts + "/index.wal";
+        cfg.lockPath     = artifacts + "/index.lock";
+        cfg.lexicalPath  = artifacts + "/lexical.bin";
+        cfg.metricsPath  = artifacts + "/engine_metrics.prom";
+        fs::create_directories(artifacts);
+    }
+
+    ~Scratch() {
+        std::error_code ec;
+        fs::remove_all(root, ec);
+    }
+};
+
+// The message of the exception fn throws, or "" if it returns.
+template <typename Fn>
+std::string errorOf(Fn&& fn) {
+    try {
+        fn();
+    } catch (const std::exception& ex) {
+        return ex.what();
+    }
+    return "";
+}
+
+void testExistsOnDisk() {
+    Scratch s("exists");
+    VectorIndex index(s.cfg);
+    check(!index.existsOnDisk(), "empty artifacts: no index on disk");
+
+    Document d;
+    d.id = index.allocateId();
+    d.sourcePath = s.cfg.dataDir + "/a.txt";
+    d.content = "pump maintenance schedule";
+    index.append(d, {1.0f, 0.0f, 0.0f});
+    check(index.existsOnDisk(), "WAL of an interrupted build counts as an index");
+
+    index.saveToDisk();
+    check(index.existsOnDisk(), "checkpoint counts as an index");
+}
+
+// Appends one chunk of `text` under data/a.txt.
+void appendChunk(VectorIndex& index, const SentraConfig& cfg, const std::string& text) {
+    Document d;
+    d.id = index.allocateId();
+    d.sourcePath = cfg.dataDir + "/a.txt";
+    d.content = text;
+    index.append(d, {1.0f, 2.0f, 3.0f});
+}
+
+std::uintmax_t walBytes(const SentraConfig& cfg) {
+    std::error_code ec;
+    auto n = fs::file_size(cfg.walPath, ec);
+    return ec ? 0 : n;
+}
+
+void testWalReplayAfterCrash() {
+    // appends after the last checkpoint live only in the WAL; a process
+    // that dies without checkpointing again must not lose them
+    Scratch s("wal_replay");
+    {
+        VectorIndex crashed(s.cfg);
+        appendChunk(crashed, s.cfg, "first chunk");
+        crashed.saveToDisk();
+        appendChunk(crashed, s.cfg, "second chunk");
+        appendChunk(crashed, s.cfg, "third chunk");
+    }
+    VectorIndex index(s.cfg);
+    index.loadFromDisk();
+    check(index.liveCount() == 3, "WAL replays the appends after the last checkpoint");
+}
+
+void testWalTornTail() {
+    // a record cut short by a crash ends replay; readers leave it alone
+    // (it may be a record being written), the writer cuts it off
+    Scratch s("wal_torn");
+    {
+        VectorIndex writer(s.cfg);
+        appendChunk(writer, s.cfg, "first chunk");
+        appendChunk(writer, s.cfg, "second chunk");
+    }
+    std::uintmax_t good = walBytes(s.cfg);
+    {
+        std::ofstream out(s.cfg.walPath, std::ios::binary | std::ios::app);
+        out.write("\x40\x00\x00\x00\x01\x02\x03\x04partial", 15);
+    }
+
+    VectorIndex reader(s.cfg);
+    reader.setWritable(false);
+    reader.loadFromDisk();
+    check(reader.liveCount() == 2 && walBytes(s.cfg) == good + 15,
+          "reader replays the good records and leaves a torn tail in place");
+
+    VectorIndex writer(s.cfg);
+    writer.loadFromDisk();
+    check(writer.liveCount() == 2 && walBytes(s.cfg) == good, "writer cuts off a torn tail");
+}
+
+void testWalCorruptRecord() {
+    // a record whose CRC does not match is treated like a torn one: it
+    // and everything after it are dropped
+    Scratch s("wal_crc");
+    {
+        VectorIndex writer(s.cfg);
+        appendChunk(writer, s.cfg, "first chunk");
+        appendChunk(writer, s.cfg, "second chunk");
+    }
+    std::string wal = readFileToString(s.cfg.walPath);
+    wal.back() ^= 0x01;
+    writeStringToFile(s.cfg.walPath, wal);
+
+    VectorIndex index(s.cfg);
+    index.loadFromDisk();
+    check(index.liveCount() == 1, "record failing its CRC is not replayed");
+    check(walBytes(s.cfg) < wal.size(), "record failing its CRC is cut off");
+    appendChunk(index, s.cfg, "third chunk");
+    VectorIndex again(s.cfg);
+    again.loadFromDisk();
+    check(again.liveCount() == 2, "records appended after the repair replay");
+}
+
+void testInterruptedCheckpointRename() {
+    // metadata.json is the commit point: a crash after its rename leaves
+    // index.bin from the previous checkpoint and the new one in .tmp, which
+    // the writer renames into place; a crash before it leaves only .tmp
+    // files, which are discarded
+    Scratch s("rename");
+    VectorIndex writer(s.cfg);
+    appendChunk(writer, s.cfg, "first chunk");
+    writer.saveToDisk();
+    std::string oldIndex = readFileToString(s.cfg.indexPath);
+    appendChunk(writer, s.cfg, "second chunk");
+    writer.saveToDisk();
+    std::string newIndex = readFileToString(s.cfg.indexPath);
+
+    writeStringToFile(s.cfg.indexPath, oldIndex);
+    writeStringToFile(s.cfg.indexPath + ".tmp", newIndex);
+    {
+        VectorIndex index(s.cfg);
+        index.loadFromDisk();
+        check(index.liveCount() == 2 && readFileToString(s.cfg.indexPath) == newIndex,
+              "writer completes a checkpoint interrupted after the metadata rename");
+    }
+
+    writeStringToFile(s.cfg.indexPath + ".tmp", "half-written index");
+    writeStringToFile(s.cfg.metaPath + ".tmp", "{\"lsn\": 9, \"docum");
+    {
+        VectorIndex index(s.cfg);
+        index.loadFromDisk();
+        check(index.liveCount() == 2 && !fs::exists(s.cfg.indexPath + ".tmp") &&
+                  !fs::exists(s.cfg.metaPath + ".tmp"),
+              "writer discards a checkpoint interrupted before the metadata rename");
+    }
+}
+
+void testBuildCheckpointsBeforeDroppingWal() {
+    // build() replaces the whole index; the WAL of the old one may only
+    // go once the new checkpoint is committed
+    Scratch s("build");
+    {
+        VectorIndex old(s.cfg);
+        appendChunk(old, s.cfg, "logged but never checkpointed");
+    }
+    VectorIndex index(s.cfg);
+    Document d;
+    d.id = "doc-0";
+    d.sourcePath = s.cfg.dataDir + "/b.txt";
+    d.content = "rebuilt chunk";
+    index.build({d}, {{0.0f, 1.0f, 0.0f}});
+    check(fs::exists(s.cfg.indexPath) && walBytes(s.cfg) == 0,
+          "build commits a checkpoint and then drops the old WAL");
+    VectorIndex fresh(s.cfg);
+    fresh.loadFromDisk();
+    check(fresh.liveCount() == 1, "old WAL records are not replayed onto a rebuilt index");
+}
+
+void testCheckpointsGrowGeometrically() {
+    // checkpoints are triggered by WAL growth relative to the last
+    // checkpoint, so a build of N chunks writes O(log N) of them
+    Scratch s("checkpoints");
+    s.cfg.checkpointMinWalBytes = 4096;
+    VectorIndex index(s.cfg);
+    int checkpoints = 0;
+    for (int i = 0; i < 4000; ++i) {
+        Document d;
+        d.id = index.allocateId();
+        d.sourcePath = s.cfg.dataDir + "/a.txt";
+        d.content = "chunk " + std::to_string(i);
+        index.append(d, std::vector<float>(16, static_cast<float>(i + 1)));
+        if (index.checkpointDue()) {
+            index.saveToDisk();
+            ++checkpoints;
+        }
+    }
+    check(checkpoints > 0 && checkpoints <= 12,
+          "4000 appends write " + std::to_string(checkpoints) + " checkpoints (expected 1-12)");
+}
+
+void testQueryProcessLoadsReadOnly() {
+    // a query process must not sync a changed data/ (which would embed new
+    // chunks before answering) nor hold the writer lock
+    Scratch s("readonly");
+    {
+        VectorIndex seed(s.cfg);
+        Document d;
+        d.id = seed.allocateId();
+        d.sourcePath = s.cfg.dataDir + "/a.txt";
+        d.content = "pump maintenance schedule";
+        seed.append(d, {1.0f, 0.0f, 0.0f});
+        seed.saveToDisk();
+    }
+    writeStringToFile(s.cfg.dataDir + "/new.txt", "a file added after the last sync");
+
+    HttpClient http(s.cfg);
+    LlmClient llm(s.cfg, http);
+    SentraEngine engine(s.cfg, llm, std::make_shared<VectorIndex>(s.cfg));
+    check(errorOf([&]() { engine.buildOrLoadIndex(); }).empty(), "query process loads the index");
+    check(engine.currentIndex()->liveCount() == 1, "query process leaves data/ to --sync");
+    IndexWriterLock other(s.cfg.lockPath);
+    check(other.tryLock(), "query process does not hold the writer lock");
+}
+
+void testMaxScoreMatchesExhaustiveBm25() {
+    // a sealed segment answers BM25 with MaxScore, which skips documents
+    // that cannot reach the top k; the mutable segment scores every
+    // matching row. The same corpus in either must rank the same.
+    Scratch s("maxscore");
+    s.cfg.memtableSize = 1 << 20;   // keep every append in the mutable segment
+    std::mt19937 rng(7);
+    std::vector<std::string> vocab;
+    for (int w = 0; w < 60; ++w) vocab.push_back("w" + std::to_string(w));
+    // skewed, so common terms have long posting lists and rare ones short
+    auto word = [&]() {
+        std::uniform_real_distribution<double> u(0.0, 1.0);
+        return vocab[static_cast<std::size_t>(std::pow(u(rng), 2.0) * vocab.size())];
+    };
+
+    std::vector<Document> docs;
+    std::vector<std::vector<float>> embs;
+    for (int i = 0; i < 500; ++i) {
+        Document d;
+        d.id = "doc-" + std::to_string(i);
+        d.sourcePath = s.cfg.dataDir + "/a.txt";
+        for (int n = 5 + static_cast<int>(rng() % 36); n > 0; --n) d.content += word() + " ";
+        docs.push_back(d);
+        embs.push_back({1.0f, 0.0f, 0.0f});
+    }
+    VectorIndex exhaustive(s.cfg);
+    for (std::size_t i = 0; i < docs.size(); ++i) {
+        std::vector<float> emb = embs[i];
+        exhaustive.append(docs[i], std::move(emb));
+    }
+    VectorIndex pruned(s.cfg);
+    pruned.build(docs, std::move(embs));
+
+    int mismatches = 0;
+    for (int q = 0; q < 200; ++q) {
+        std::string query;
+        for (int n = 1 + static_cast<int>(rng() % 4); n > 0; --n) query += word() + " ";
+        auto want = exhaustive.searchLexical(query, 11);   // the 11th shows ties at the cut
+        auto got = pruned.searchLexical(query, 10);
+        bool same = std::min<std::size_t>(want.size(), 10) == got.size();
+        for (std::size_t i = 0; same && i < got.size(); ++i) {
+            same = std::fabs(want[i].score - got[i].score) <= 1e-4f * std::max(1.0f, want[i].score);
+            // ids may only differ where scores tie
+            bool tied = i + 1 < want.size() && want[i].score - want[i + 1].score <= 1e-4f;
+            tied = tied || (i > 0 && want[i - 1].score - want[i].score <= 1e-4f);
+            same = same && (tied || want[i].doc->id == got[i].doc->id);
+        }
+        if (!same) ++mismatches;
+    }
+    check(mismatches == 0, "MaxScore top-10 matches exhaustive BM25 on 200 queries (" +
+                               std::to_string(mismatches) + " differ)");
+}
+
+std::vector<uint32_t> rowsOf(const RowBitmap& bitmap) {
+    std::vector<uint32_t> rows;
+    bitmap.forEach([&](uint32_t row) { rows.push_back(row); });
+    return rows;
+}
+
+RowBitmap bitmapOf(const std::set<uint32_t>& rows) {
+    RowBitmap bitmap;
+    for (uint32_t row : rows) bitmap.add(row);
+    return bitmap;
+}
+
+void testRowBitmapContainers() {
+    // a 2^16-row chunk is an array up to 4096 rows and a bitset past that
+    RowBitmap bitmap;
+    std::vector<uint32_t> want;
+    for (uint32_t row = 0; row < 2 * 4096; row += 2) {
+        bitmap.add(row);
+        want.push_back(row);
+    }
+    bool arrayOk = bitmap.cardinality() == 4096 && bitmap.contains(8190) && !bitmap.contains(8191);
+    bitmap.add(9000);
+    want.push_back(9000);
+    bitmap.add(70000);   // second chunk
+    want.push_back(70000);
+    check(arrayOk && bitmap.cardinality() == 4098 && rowsOf(bitmap) == want &&
+              bitmap.contains(9000) && !bitmap.contains(8999) && bitmap.contains(70000),
+          "bitmap keeps its rows across the array-to-bitset switch");
+}
+
+void testRowBitmapSetOperations() {
+    // or / and / and-not against std::set, at densities that pair array
+    // and bitset chunks every way
+    std::mt19937 rng(11);
+    int wrong = 0;
+    for (double da : {0.001, 0.05, 0.3}) {
+        for (double db : {0.001, 0.05, 0.3}) {
+            std::set<uint32_t> a, b;
+            std::bernoulli_distribution inA(da), inB(db);
+            for (uint32_t row = 0; row < 3 * 65536; ++row) {
+                if (inA(rng)) a.insert(row);
+                if (inB(rng)) b.insert(row);
+            }
+            std::set<uint32_t> both, either, only;
+            std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::inserter(both, both.end()));
+            std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::inserter(either, either.end()));
+            std::set_difference(a.begin(), a.end(), b.begin(), b.end(), std::inserter(only, only.end()));
+
+            RowBitmap u = bitmapOf(a), i = bitmapOf(a), d = bitmapOf(a);
+            u.unionWith(bitmapOf(b));
+            i.intersectWith(bitmapOf(b));
+            d.subtract(bitmapOf(b));
+            auto same = [](const RowBitmap& got, const std::set<uint32_t>& want) {
+                return got.cardinality() == want.size() &&
+                       rowsOf(got) == std::vector<uint32_t>(want.begin(), want.end());
+            };
+            if (!same(u, either) || !same(i, both) || !same(d, only)) ++wrong;
+        }
+    }
+    check(wrong == 0, "bitmap or/and/and-not match std::set (" + std::to_string(wrong) + " of 9 differ)");
+}
+
+void testFilterAcrossSegmentsAndTombstones() {
+    // --filter matches by source prefix in sealed segments (bitmaps) and
+    // the mutable one (per-row check), and never returns deleted rows
+    Scratch s("filter");
+    s.cfg.memtableSize = 4;
+    VectorIndex index(s.cfg);
+    std::string acme = s.cfg.dataDir + "/acme/";
+    auto add = [&](const std::string& source, const std::string& text) {
+        Document d;
+        d.id = index.allocateId();
+        d.sourcePath = source;
+        d.content = text;
+        index.append(d, {1.0f, 0.0f, 0.0f});
+    };
+    for (int i = 0; i < 3; ++i) {
+        add(acme + "pumps.txt", "pump seal replacement " + std::to_string(i));
+        add(s.cfg.dataDir + "/other/pumps.txt", "pump seal replacement " + std::to_string(i));
+        add(acme + "old.txt", "pump seal replacement old " + std::to_string(i));
+    }
+    add(acme + "new.txt", "pump seal replacement new");   // mutable segment
+    index.waitForMerges();
+    index.removeSource(acme + "old.txt");
+
+    SearchFilter filter;
+    filter.pathPrefixes.push_back(acme);
+    auto sources = [&](const std::vector<Candidate>& hits) {
+        std::set<std::string> out;
+        for (const auto& c : hits) out.insert(std::string(c.sourcePath()));
+        return out;
+    };
+    std::set<std::string> want = {acme + "pumps.txt", acme + "new.txt"};
+    auto vector = index.search({1.0f, 0.0f, 0.0f}, 20, filter);
+    auto lexical = index.searchLexical("pump seal", 20, filter);
+    check(vector.size() == 4 && sources(vector) == want,
+          "vector search filters by prefix across segments and skips deleted rows");
+    check(lexical.size() == 4 && sources(lexical) == want,
+          "BM25 search filters by prefix across segments and skips deleted rows");
+
+    SearchFilter deleted;
+    deleted.sources.push_back(acme + "old.txt");
+    check(index.search({1.0f, 0.0f, 0.0f}, 20, deleted).empty() &&
+              index.searchLexical("pump seal", 20, deleted).empty(),
+          "filter on a deleted source matches nothing");
+}
+
+void testReaderRetriesTornCheckpoint() {
+    // a reader that lands between the writer's renames of metadata.json
+    // and index.bin sees two checkpoints; it must wait for the second
+    // rename instead of failing
+    Scratch s("torn");
+    VectorIndex writer(s.cfg);
+    auto add = [&](const std::string& text) {
+        Document d;
+        d.id = writer.allocateId();
+        d.sourcePath = s.cfg.dataDir + "/a.txt";
+        d.content = text;
+        writer.append(d, {1.0f, 2.0f, 3.0f});
+    };
+    add("first chunk");
+    writer.saveToDisk();
+    std::string oldIndex = readFileToString(s.cfg.indexPath);
+    add("second chunk");
+    writer.saveToDisk();
+    std::string newIndex = readFileToString(s.cfg.indexPath);
+
+    writeStringToFile(s.cfg.indexPath, oldIndex);   // metadata renamed, index.bin not yet
+    auto rename = std::async(std::launch::async, [&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        writeStringToFile(s.cfg.indexPath + ".next", newIndex);
+        fs::rename(s.cfg.indexPath + ".next", s.cfg.indexPath);
+    });
+    VectorIndex reader(s.cfg);
+    reader.setWritable(false);
+    std::string error = errorOf([&]() { reader.loadFromDisk(); });
+    rename.wait();
+    check(error.empty() && reader.liveCount() == 2, "reader retries a torn checkpoint" +
+          (error.empty() ? "" : ": " + error));
+}
+
+void testReaderRetriesTruncatedWal() {
+    // the writer can commit a checkpoint and truncate the WAL between a
+    // reader's reads of the old checkpoint and the WAL; replaying what is
+    // left onto the old checkpoint would silently drop the records in
+    // between, so the reader must notice the gap and read again
+    Scratch s("wal_gap");
+    VectorIndex writer(s.cfg);
+    appendChunk(writer, s.cfg, "first chunk");
+    writer.saveToDisk();
+    std::string oldIndex = readFileToString(s.cfg.indexPath);
+    std::string oldMeta = readFileToString(s.cfg.metaPath);
+    appendChunk(writer, s.cfg, "second chunk");
+    writer.saveToDisk();
+    std::string newIndex = readFileToString(s.cfg.indexPath);
+    std::string newMeta = readFileToString(s.cfg.metaPath);
+    appendChunk(writer, s.cfg, "third chunk");   // the WAL now starts after the second
+
+    // the reader's view: the first checkpoint, then the truncated WAL
+    writeStringToFile(s.cfg.indexPath, oldIndex);
+    writeStringToFile(s.cfg.metaPath, oldMeta);
+    auto commit = std::async(std::launch::async, [&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        writeStringToFile(s.cfg.metaPath + ".next", newMeta);
+        fs::rename(s.cfg.metaPath + ".next", s.cfg.metaPath);
+        writeStringToFile(s.cfg.indexPath + ".next", newIndex);
+        fs::rename(s.cfg.indexPath + ".next", s.cfg.indexPath);
+    });
+    VectorIndex reader(s.cfg);
+    reader.setWritable(false);
+    std::string error = errorOf([&]() { reader.loadFromDisk(); });
+    commit.wait();
+    check(error.empty() && reader.liveCount() == 3,
+          "reader rereads when the WAL was truncated past its checkpoint (" +
+              std::to_string(reader.liveCount()) + " chunks" + (error.empty() ? "" : ", " + error) + ")");
+}
+
+// A candidate for `doc` with `score`; fusion only looks at ids and scores.
+Candidate candidate(const Document& doc, float score) {
+    Candidate c;
+    c.doc = &doc;
+    c.score = score;
+    return c;
+}
+
+std::string idsOf(const std::vector<Candidate>& list) {
+    std::string ids;
+    for (const auto& c : list) ids += std::string(c.id()) + " ";
+    return ids;
+}
+
+void testReciprocalRankFusion() {
+    Document a, b, c, d;
+    a.id = "a";
+    b.id = "b";
+    c.id = "c";
+    d.id = "d";
+    // c is third in one list and first in the other, so it beats a
+    // (first in one list only); b and d are both second once and tie
+    auto fused = fuseCandidates({{1.0f, {candidate(a, 0.9f), candidate(b, 0.8f), candidate(c, 0.7f)}},
+                                 {1.0f, {candidate(c, 12.0f), candidate(d, 3.0f)}}},
+                                FusionMode::ReciprocalRank, 10);
+    check(fused.size() == 4 && fused[0].id() == "c" && fused[1].id() == "a",
+          "RRF ranks a chunk found by both retrievers first (" + idsOf(fused) + ")");
+    check(fused.size() == 4 && std::fabs(fused[0].score - (1.0f / 63 + 1.0f / 61)) < 1e-6f,
+          "RRF scores sum w / (60 + rank)");
+    check(fused.size() == 4 && fused[2].score == fused[3].score,
+          "RRF ties chunks at the same rank in lists of the same weight");
+
+    auto weighted = fuseCandidates({{2.0f, {candidate(a, 0.1f)}}, {1.0f, {candidate(b, 50.0f)}}},
+                                   FusionMode::ReciprocalRank, 10);
+    check(weighted.size() == 2 && weighted[0].id() == "a", "RRF weights lists, ignoring raw scores");
+
+    auto cut = fuseCandidates({{1.0f, {candidate(a, 3.0f), candidate(b, 2.0f), candidate(c, 1.0f)}}},
+                              FusionMode::ReciprocalRank, 2);
+    check(cut.size() == 2 && cut[0].id() == "a" && cut[1].id() == "b", "fusion keeps the top k");
+}
+
+void testWeightedFusion() {
+    Document a, b, c;
+    a.id = "a";
+    b.id = "b";
+    c.id = "c";
+    // each list is scaled to [0, 1] on its own, so BM25's scale (tens)
+    // does not swamp cosine similarity: a = 1 + 0, c = 0 + 1, b = 0.5
+    auto fused = fuseCandidates({{1.0f, {candidate(a, 0.9f), candidate(b, 0.5f), candidate(c, 0.1f)}},
+                                 {1.0f, {candidate(c, 40.0f), candidate(a, 10.0f)}}},
+                                FusionMode::WeightedSum, 10);
+    check(fused.size() == 3 && fused[2].id() == "b" && std::fabs(fused[2].score - 0.5f) < 1e-6f,
+          "weighted fusion min-max scales each list (" + idsOf(fused) + ")");
+    check(fused.size() == 3 && fused[0].score == 1.0f && fused[1].score == 1.0f,
+          "weighted fusion ties chunks each at the top of one list");
+
+    auto single = fuseCandidates({{0.5f, {candidate(a, 0.3f)}}}, FusionMode::WeightedSum, 10);
+    check(single.size() == 1 && single[0].score == 0.5f,
+          "a list with one score counts as fully relevant");
+}
+
+void testMmrTradesRelevanceForDiversity() {
+    // three near-identical chunks outscore two unrelated ones; lambda 1
+    // keeps pure relevance order, lambda 0.5 takes one of the copies and
+    // fills the rest with the unrelated chunks
+    std::vector<std::vector<float>> vecs = {
+        {1.0f, 0.0f, 0.0f}, {0.99f, 0.01f, 0.0f}, {0.98f, 0.0f, 0.02f}, {0.0f, 1.0f, 0.0f}, {0.0f, 0.0f, 1.0f}};
+    std::vector<Document> docs(5);
+    const char* ids[] = {"a", "a2", "a3", "b", "c"};
+    float scores[] = {1.0f, 0.95f, 0.9f, 0.6f, 0.5f};
+    std::vector<Candidate> pool;
+    for (std::size_t i = 0; i < docs.size(); ++i) {
+        docs[i].id = ids[i];
+        Candidate c = candidate(docs[i], scores[i]);
+        c.embedding = vecs[i].data();
+        c.dim = 3;
+        c.norm = std::sqrt(vecs[i][0] * vecs[i][0] + vecs[i][1] * vecs[i][1] + vecs[i][2] * vecs[i][2]);
+        pool.push_back(c);
+    }
+    auto relevant = diversifyMmr(pool, 3, 1.0f);
+    auto diverse = diversifyMmr(pool, 3, 0.5f);
+    check(idsOf(relevant) == "a a2 a3 ", "MMR with lambda 1 keeps relevance order (" + idsOf(relevant) + ")");
+    check(idsOf(diverse) == "a b c ", "MMR with lambda 0.5 skips near-duplicates (" + idsOf(diverse) + ")");
+}
+
+void testFuseLeavesOutLateRetriever() {
+    // a retriever that misses its deadline is parked and left out; the
+    // others' results are fused without it
+    Scratch s("deadline");
+    s.cfg.mmrLambda = 1.0f;
+    HttpClient http(s.cfg);
+    LlmClient llm(s.cfg, http);
+    SentraEngine engine(s.cfg, llm, std::make_shared<VectorIndex>(s.cfg));
+    Document fast, slow;
+    fast.id = "fast";
+    slow.id = "slow";
+    std::vector<Retriever> retrievers = {
+        {"fast", 1.0f, std::chrono::milliseconds(1000),
+         [&](int) { return std::vector<Candidate>{candidate(fast, 1.0f)}; }},
+        {"slow", 1.0f, std::chrono::milliseconds(50),
+         [&](int) {
+             std::this_thread::sleep_for(std::chrono::milliseconds(300));
+             return std::vector<Candidate>{candidate(slow, 1.0f)};
+         }},
+    };
+    auto t0 = std::chrono::steady_clock::now();
+    auto fused = engine.fuse(retrievers);
+    auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    check(fused.size() == 1 && fused[0].id() == "fast" && ms < 250,
+          "retriever past its deadline is left out (" + idsOf(fused) + std::to_string(static_cast<int>(ms)) +
+              " ms)");
+}
+
+void testGatedFuseDoesNotWait() {
+    // an empty gating list ends retrieval at once; the slower retrievers
+    // are parked rather than waited for
+    Scratch s("gate");
+    HttpClient http(s.cfg);
+    LlmClient llm(s.cfg, http);
+    SentraEngine engine(s.cfg, llm, std::make_shared<VectorIndex>(s.cfg));
+    std::vector<Retriever> retrievers = {
+        {"gate", 1.0f, std::chrono::milliseconds(2000),
+         [](int) { return std::vector<Candidate>{}; }, true},
+        {"slow", 1.0f, std::chrono::milliseconds(2000),
+         [](int) {
+             std::this_thread::sleep_for(std::chrono::milliseconds(500));
+             return std::vector<Candidate>{};
+         }},
+    };
+    auto t0 = std::chrono::steady_clock::now();
+    auto fused = engine.fuse(retrievers);
+    auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    check(fused.empty() && ms < 250, "empty gate returns without waiting for the others (" +
+          std::to_string(static_cast<int>(ms)) + " ms)");
+}
+
+void testShortChunksKeepDistinctIds() {
+    // short chunks a part number apart are separate facts; only identical
+    // short chunks and long near-identical ones collapse
+    auto doc = [](const std::string& src, const std::string& text) {
+        Document d;
+        d.sourcePath = src;
+        d.content = text;
+        return d;
+    };
+    std::string notice;
+    for (int i = 0; i < 40; ++i) notice += "this manual is provided as is without warranty of any kind ";
+    std::string part = "Replace the hydraulic filter cartridge on the main pump assembly every five "
+                       "hundred operating hours using the service kit listed in the maintenance "
+                       "table for this model: FX-";
+    std::vector<Document> docs = {
+        doc("a.txt", part + "1009"),
+        doc("b.txt", part + "1010"),   // a few SimHash bits from a.txt
+        doc("c.txt", part + "1009"),
+        doc("d.txt", notice + "rev 1"),
+        doc("e.txt", notice + "rev 2"),
+    };
+    std::size_t dropped = collapseNearDuplicates(docs, 3, 32);
+    check(dropped == 2 && docs.size() == 3,
+          "short chunks differing in a part number are kept (" + std::to_string(dropped) + " dropped)");
+}
+
+void testTracerStopsUnderLoad() {
+    // spans racing ~Tracer must either land in the trace or be dropped;
+    // none may touch the ring after it is freed (run under
+    // -fsanitize=address to see a violation)
+    Scratch s("tracer");
+    std::atomic<bool> done{false};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&]() {
+            while (!done.load()) {
+                TraceSpan span("test.span", "test");
+                TraceSpan::emit("test.emit", "test", 0, 1);
+                if (Tracer::active()) {   // outlive ~Tracer's 50 ms writer join
+                    std::this_thread::sleep_for(std::chrono::milliseconds(80));
+                }
+            }
+        });
+    }
+    for (int i = 0; i < 20; ++i) {
+        auto tracer = std::make_unique<Tracer>((s.root / "trace.json").string());
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    done.store(true);
+    for (auto& t : threads) t.join();
+    check(!Tracer::active(), "tracer stops while spans are being recorded");
+}
+
+void testExactIdentifierOverridesGate() {
+    // with --min-score the semantic list can be empty for a bare part
+    // number; a keyword hit naming it exactly keeps the query on-topic
+    Scratch s("identifier");
+    s.cfg.mmrLambda = 1.0f;
+    HttpClient http(s.cfg);
+    LlmClient llm(s.cfg, http);
+    SentraEngine engine(s.cfg, llm, std::make_shared<VectorIndex>(s.cfg));
+    Document part, other;
+    part.id = "part";
+    part.content = "Filter cartridge FX-1004 fits the P200 pump.";
+    other.id = "other";
+    other.content = "Filter cartridge FX-1005 fits the P300 pump.";
+
+    check(hasExactIdentifierHit("What is FX-1004?", {candidate(part, 1.0f)}) &&
+              !hasExactIdentifierHit("What is FX-1004?", {candidate(other, 1.0f)}) &&
+              !hasExactIdentifierHit("filter cartridge", {candidate(part, 1.0f)}),
+          "only a verbatim letters-and-digits token counts as an identifier hit");
+
+    auto fuseFor = [&](const std::string& question, const Document& hit) {
+        std::vector<Retriever> retrievers = {
+            {"semantic", 1.0f, std::chrono::milliseconds(1000),
+             [](int) { return std::vector<Candidate>{}; }, true},
+            {"keyword", 1.0f, std::chrono::milliseconds(1000),
+             [&](int) { return std::vector<Candidate>{candidate(hit, 3.0f)}; }, true,
+             [question](const std::vector<Candidate>& hits) { return hasExactIdentifierHit(question, hits); }},
+        };
+        return engine.fuse(retrievers);
+    };
+    auto found = fuseFor("FX-1004", part);
+    check(found.size() == 1 && found[0].id() == "part",
+          "exact identifier keyword hit answers despite an empty semantic list");
+    check(fuseFor("FX-1004", other).empty(), "keyword hit without the identifier is still off-topic");
+}
+
+void testCassetteReplay() {
+    // a recording made through curl (from file:// URLs, so no server is
+    // needed) replays byte for byte, in recorded order per request with
+    // the last one repeating, without touching the source again; an
+    // unrecorded request is an error
+    Scratch s("cassette");
+    fs::path api = s.root / "api";
+    fs::create_directories(api / "chat");
+    std::string path = (s.root / "trace.cas").string();
+    std::string first("{\"data\": [1, 2]}\n\0\xff\xfe tail", 24);
+    std::string second = "{\"data\": [3]}";
+    std::string chat = "{\"choices\": []}";
+    s.cfg.baseUrl = "file://" + api.string();
+    s.cfg.httpCassettePath = path;
+    const std::string body = "{\"input\":\"a\"}";
+    {
+        s.cfg.httpCassetteMode = "record";
+        HttpClient http(s.cfg);
+        writeStringToFile((api / "embeddings").string(), first);
+        http.postJson("/embeddings", body);
+        writeStringToFile((api / "chat" / "completions").string(), chat);
+        http.postJson("/chat/completions", "{}");
+        writeStringToFile((api / "embeddings").string(), second);
+        http.postJson("/embeddings", body);
+    }
+    fs::remove_all(api);
+
+    s.cfg.httpCassetteMode = "replay";
+    s.cfg.replayLatency = "none";
+    HttpClient http(s.cfg);
+    auto post = [&](const std::string& route, const std::string& json) {
+        return std::string(http.postJson(route, json));
+    };
+    std::string r1 = post("/embeddings", body);
+    std::string r2 = post("/embeddings", body);
+    std::string r3 = post("/embeddings", body);
+    check(r1 == first && r2 == second && r3 == second,
+          "cassette replays responses byte for byte, in order, repeating the last");
+    check(post("/chat/completions", "{}") == chat, "cassette keeps requests apart by path and body");
+    check(errorOf([&]() { post("/embeddings", "{\"input\":\"b\"}"); }) ==
+              "No recorded response for /embeddings request in " + path,
+          "unrecorded request fails instead of reaching the network");
+
+    s.cfg.replayLatency = "fast";
+    check(errorOf([&]() { HttpClient bad(s.cfg); }) == "Unknown replay latency: fast",
+          "unknown replay latency is rejected");
+}
+
+void testJsonStringMatchesDump() {
+    // the hand serializer writes the bytes json::dump() would, and rejects
+    // malformed UTF-8 with the same type_error instead of passing it on
+    auto serialize = [](const std::string& text) {
+        std::pmr::string out;
+        appendJsonString(out, text);
+        return std::string(out);
+    };
+    std::vector<std::string> valid = {
+        "", "plain", "quote \" backslash \\ slash /", std::string("nul \0 bell \a", 12),
+        "\b\f\n\r\t\x1f\x7f", "caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80 \xf4\x8f\xbf\xbf \xed\x9f\xbf",
+    };
+    bool same = true;
+    for (const auto& text : valid) same = same && serialize(text) == json(text).dump();
+    check(same, "serialized strings match json::dump() byte for byte");
+
+    std::vector<std::string> invalid = {
+        "lone \x80", "cut \xc3", "overlong \xc0\xaf", "overlong \xe0\x80\xaf", "surrogate \xed\xa0\x80",
+        "past max \xf4\x90\x80\x80", "bad \xf5\x80\x80\x80", "short \xe2\x82 x", "\xff",
+    };
+    bool rejected = true;
+    for (const auto& text : invalid) {
+        std::string expected = errorOf([&]() { json(text).dump(); });
+        rejected = rejected && !expected.empty() && errorOf([&]() { serialize(text); }) == expected;
+    }
+    check(rejected, "malformed UTF-8 throws the json::dump() error");
+}
+
+// Random JSON text: mostly valid values, some with a byte or two broken.
+std::string randomJson(std::mt19937& rng, int depth) {
+    static const std::vector<std::string> scalars = {
+        "0", "-0", "7", "-12", "0.5", "1e5", "1E+2", "2.5e-3", "1e-50", "4e38", "true", "false", "null",
+        "\"\"", "\"a\"", "\"\\\"\\\\\\/\\b\\f\\n\\r\\t\"", "\"\\u00e9\\u20ac\"", "\"\\ud83d\\ude00\"",
+        "\"caf\xc3\xa9 \xf0\x9f\x98\x80\"",
+    };
+    std::uniform_int_distribution<int> pick(0, 9);
+    int kind = depth > 3 ? 9 : pick(rng);
+    std::string out;
+    if (kind < 2) {
+        out += '{';
+        int n = pick(rng) % 4;
+        for (int i = 0; i < n; ++i) {
+            out += (i ? "," : "") + std::string("\"k") + std::to_string(i) + "\" : " + randomJson(rng, depth + 1);
+        }
+        out += '}';
+    } else if (kind < 4) {
+        out += "[ ";
+        int n = pick(rng) % 4;
+        for (int i = 0; i < n; ++i) out += (i ? ",\n" : "") + randomJson(rng, depth + 1);
+        out += ']';
+    } else {
+        out = scalars[rng() % scalars.size()];
+    }
+    return out;
+}
+
+std::string mutate(std::string text, std::mt19937& rng) {
+    static const std::string alphabet = "{}[]\",:.-+eE019tfnrul \t\\/\x01\xc3\xa9\x80";
+    int edits = static_cast<int>(rng() % 3);
+    for (int e = 0; e < edits && !text.empty(); ++e) {
+        std::size_t at = rng() % text.size();
+        switch (rng() % 3) {
+            case 0: text.erase(at, 1); break;
+            case 1: text.insert(at, 1, alphabet[rng() % alphabet.size()]); break;
+            default: text[at] = alphabet[rng() % alphabet.size()];
+        }
+    }
+    return text;
+}
+
+void testJsonCursorAcceptsWhatDomAccepts() {
+    // the cursor's grammar is the DOM's: literals, numbers, strings and
+    // escapes are checked in full, and nothing but whitespace may follow
+    auto accepts = [](const std::string& text) {
+        JsonCursor in{text.data(), text.data() + text.size()};
+        return errorOf([&]() {
+            in.skip();
+            in.finish();
+        }).empty();
+    };
+    std::vector<std::string> cases = {
+        "tru", "nul", "[true]", "[tru]", "[truex]", "[1.]", "[.5]", "[01]", "[-]", "[1e]", "[1e+]", "[+1]",
+        "[-0.0e-0]", "{\"data\":[]} trailing", "{\"data\":[]} \n", "{\"a\":1,}", "[1,]", "\"\\x\"",
+        "\"\\ud800\"", "\"\\udc00\"", "\"\\ud800\\u0041\"", "\"tab\there\"", "\"\xc3\"", "\"\xed\xa0\x80\"", "",
+    };
+    std::mt19937 rng(50);
+    for (int i = 0; i < 20000; ++i) cases.push_back(mutate(randomJson(rng, 0), rng));
+    std::size_t agree = 0, valid = 0;
+    for (const auto& text : cases) {
+        bool dom = json::accept(text);
+        if (accepts(text) == dom) ++agree;
+        if (dom) ++valid;
+    }
+    check(agree == cases.size() && valid > cases.size() / 4 && valid < cases.size(),
+          "JSON cursor accepts exactly the documents the DOM parser accepts");
+}
+
+void testEmbeddingResponseMatchesDom() {
+    // floats, indexes and usage read by the cursor match the DOM's values,
+    // including numbers past float range, which clamp to 0 and +-inf
+    static const std::vector<std::string> edges = {
+        "1e-50", "-1e-50", "4e38", "-4e38", "3.4028235e38", "1.17549435e-38", "1e-45", "-0", "1E+2",
+    };
+    std::mt19937 rng(51);
+    std::normal_distribution<float> gauss(0.0f, 1.0f);
+    bool same = true;
+    for (int doc = 0; doc < 50; ++doc) {
+        std::size_t batch = 1 + rng() % 4, dim = 1 + rng() % 16;
+        std::ostringstream text;
+        text << " {\"object\": \"list\", \"data\": [";
+        for (std::size_t b = 0; b < batch; ++b) {
+            text << (b ? ", " : "") << "{\"object\": \"embedding\", \"index\": " << (batch - 1 - b)
+                 << ", \"embedding\": [";
+            for (std::size_t d = 0; d < dim; ++d) {
+                text << (d ? "," : "");
+                if (rng() % 4 == 0) {
+                    text << edges[rng() % edges.size()];
+                } else {
+                    text << std::setprecision(9) << gauss(rng);
+                }
+            }
+            text << "]}";
+        }
+        text << "], \"model\": \"m\", \"usage\": {\"prompt_tokens\": " << doc << ", \"total_tokens\": 1}}\n";
+
+        json dom = json::parse(text.str());
+        EmbeddingResponse parsed;
+        parsed.parse(text.str());
+        same = same && parsed.vectors.size() == batch && parsed.usage.model == "m" &&
+               parsed.usage.promptTokens == static_cast<uint64_t>(doc);
+        for (const auto& item : dom["data"]) {
+            std::size_t at = item["index"].get<std::size_t>();
+            std::vector<float> expected = item["embedding"].get<std::vector<float>>();
+            same = same && at < parsed.vectors.size() && parsed.vectors[at] == expected;
+        }
+    }
+    check(same, "embedding response floats match the DOM's, clamping out-of-range numbers");
+
+    EmbeddingResponse parsed;
+    check(errorOf([&]() { parsed.parse("{\"data\": [{\"embedding\": [1.]}]}"); }) == "Malformed JSON response",
+          "embedding response with a malformed number is rejected");
+    check(errorOf([&]() { parsed.parse("{\"data\": []} trailing"); }) == "Malformed JSON response",
+          "embedding response with trailing text is rejected");
+}
+
+void testFreshBuild() {
+    // with no index yet the engine builds in the foreground, so an empty
+    // data/ is reported instead of serving an empty index
+    Scratch s("fresh");
+    HttpClient http(s.cfg);
+    LlmClient llm(s.cfg, http);
+    SentraEngine engine(s.cfg, llm, std::make_shared<VectorIndex>(s.cfg));
+    check(errorOf([&]() { engine.buildOrLoadIndex(); }) == "No documents found in data directory.",
+          "fresh build of an empty data directory fails");
+}
+
+void testFreshBuildLocked() {
+    Scratch s("locked");
+    IndexWriterLock other(s.cfg.lockPath);
+    check(other.tryLock(), "writer lock taken by another holder");
+    HttpClient http(s.cfg);
+    LlmClient llm(s.cfg, http);
+    SentraEngine engine(s.cfg, llm, std::make_shared<VectorIndex>(s.cfg));
+    check(errorOf([&]() { engine.buildOrLoadIndex(); }) ==
+              "Index is being built by another process; try again shortly.",
+          "fresh build while another process holds the writer lock");
+}
+
+}  // namespace
+
+int main() {
+    try {
+        testExistsOnDisk();
+        testWalReplayAfterCrash();
+        testWalTornTail();
+        testWalCorruptRecord();
+        testInterruptedCheckpointRename();
+        testBuildCheckpointsBeforeDroppingWal();
+        testCheckpointsGrowGeometrically();
+        testMaxScoreMatchesExhaustiveBm25();
+        testRowBitmapContainers();
+        testRowBitmapSetOperations();
+        testFilterAcrossSegmentsAndTombstones();
+        testQueryProcessLoadsReadOnly();
+        testReaderRetriesTornCheckpoint();
+        testReaderRetriesTruncatedWal();
+        testReciprocalRankFusion();
+        testWeightedFusion();
+        testMmrTradesRelevanceForDiversity();
+        testFuseLeavesOutLateRetriever();
+        testGatedFuseDoesNotWait();
+        testShortChunksKeepDistinctIds();
+        testTracerStopsUnderLoad();
+        testExactIdentifierOverridesGate();
+        testCassetteReplay();
+        testJsonStringMatchesDump();
+        testJsonCursorAcceptsWhatDomAccepts();
+        testEmbeddingResponseMatchesDom();
+        testFreshBuild();
+        testFreshBuildLocked();
+    } catch (const std::exception& ex) {
+        std::cerr << "Fatal error: " << ex.what() << "\n";
+        return 1;
+    }
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed\n";
+        return 1;
+    }
+    std::cout << "All checks passed.\n";
+    return 0;
+}